@@ -0,0 +1,105 @@
+#pragma once
+// progressive float32 radiance buffer.
+//
+// Rays splat their segments into a persistent RGB float buffer instead of
+// being drawn with a tiny alpha every frame. The buffer keeps summing across
+// frames while the scene stays the same, and is tonemapped into a texture for
+// display, so the picture converges instead of being capped by what fits in one
+// frame. Call reset() whenever anything that changes the picture changes.
+#include "optics.h"
+#include "threadpool.h"
+#include <vector>
+
+// reinhard, per channel, after scaling by exposure.
+static Color tonemapReinhard(Vector3 r, float scale) {
+  const float x = r.x * scale, y = r.y * scale, z = r.z * scale;
+  return Color{
+    (unsigned char)(255 * x / (1 + x)),
+    (unsigned char)(255 * y / (1 + y)),
+    (unsigned char)(255 * z / (1 + z)),
+    255};
+}
+
+struct Accumulator {
+  int width = 0;
+  int height = 0;
+  int nframes = 0; // frames summed since the last reset.
+  float exposure = 1;
+  std::vector<Vector3> radiance;
+  std::vector<Color> pixels;
+  Texture2D texture = {};
+  bool textureLoaded = false;
+
+  // (re)allocate for a width x height target, resetting if the size changed.
+  void resize(int w, int h) {
+    if (w == width && h == height) { return; }
+    width = w;
+    height = h;
+    radiance.assign(width * height, Vector3{0, 0, 0});
+    pixels.assign(width * height, Color{0, 0, 0, 255});
+    if (textureLoaded) { UnloadTexture(texture); textureLoaded = false; }
+    nframes = 0;
+  }
+
+  void reset() {
+    std::fill(radiance.begin(), radiance.end(), Vector3{0, 0, 0});
+    nframes = 0;
+  }
+
+  // add c to the four pixels around p, bilinearly.
+  void splat(Vector2 p, Vector3 c) {
+    const float fx = p.x - 0.5f;
+    const float fy = p.y - 0.5f;
+    const int x0 = floorf(fx);
+    const int y0 = floorf(fy);
+    const float tx = fx - x0;
+    const float ty = fy - y0;
+    add(x0, y0, c, (1 - tx) * (1 - ty));
+    add(x0 + 1, y0, c, tx * (1 - ty));
+    add(x0, y0 + 1, c, (1 - tx) * ty);
+    add(x0 + 1, y0 + 1, c, tx * ty);
+  }
+
+  // deposit c per pixel of length along the segment.
+  void segment(Vector2 start, Vector2 end, Vector3 c) {
+    const float length = Vector2Distance(start, end);
+    const int nsamples = std::max<int>(1, ceilf(length));
+    const float weight = length / nsamples;
+    const Vector3 cw = {c.x * weight, c.y * weight, c.z * weight};
+    for(int i = 0; i < nsamples; ++i) {
+      splat(Vector2Lerp(start, end, (i + 0.5f) / nsamples), cw);
+    }
+  }
+
+  // end of the frame's contributions.
+  void endFrame() { nframes++; }
+
+  // tonemap the mean per-frame radiance into the texture and draw it.
+  void draw() {
+    if (width == 0 || height == 0) { return; }
+    if (!textureLoaded) {
+      Image image = GenImageColor(width, height, BLACK);
+      texture = LoadTextureFromImage(image);
+      UnloadImage(image);
+      textureLoaded = true;
+    }
+    const float scale = exposure / std::max<int>(1, nframes);
+    threadPool().parallelFor(height, 16, [&](int begin, int end, int participant) {
+      for(int i = begin * width; i < end * width; ++i) {
+        pixels[i] = tonemapReinhard(radiance[i], scale);
+      }
+    });
+    UpdateTexture(texture, pixels.data());
+    DrawTexture(texture, 0, 0, WHITE);
+  }
+
+private:
+  void add(int x, int y, Vector3 c, float w) {
+    if (x < 0 || y < 0 || x >= width || y >= height) { return; }
+    Vector3 &r = radiance[y * width + x];
+    r.x += c.x * w;
+    r.y += c.y * w;
+    r.z += c.z * w;
+  }
+};
+
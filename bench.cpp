@@ -0,0 +1,139 @@
+// headless benchmark: traces every scene with fixed parameters and no window,
+// and reports tracer throughput.
+#include "raymarch.h"
+#include "sdftape.h"
+#include "sdfbvh.h"
+#include <chrono>
+
+void *sceneA_init();
+void *sceneB_init();
+void *sceneC_init();
+void *sceneD_init();
+void *sceneF_init();
+
+void sceneA_bench(void*, BenchParams, TraceStats*);
+void sceneB_bench(void*, BenchParams, TraceStats*);
+void sceneB_benchGrid(void*, BenchParams, TraceStats*);
+void sceneC_bench(void*, BenchParams, TraceStats*);
+void sceneD_bench(void*, BenchParams, TraceStats*);
+void sceneF_bench(void*, BenchParams, TraceStats*);
+void sceneD_benchPacket(void*, BenchParams, TraceStats*);
+void sceneF_benchPacket(void*, BenchParams, TraceStats*);
+void sceneA_benchAdaptive(void*, BenchParams, TraceStats*);
+void sceneB_benchAdaptive(void*, BenchParams, TraceStats*);
+void sceneD_benchAdaptive(void*, BenchParams, TraceStats*);
+void sceneF_benchAdaptive(void*, BenchParams, TraceStats*);
+void sceneD_benchCone(void*, BenchParams, TraceStats*);
+void sceneF_benchCone(void*, BenchParams, TraceStats*);
+void sceneD_benchWavefront(void*, BenchParams, TraceStats*);
+void sceneF_benchWavefront(void*, BenchParams, TraceStats*);
+void sceneD_benchSpectral(void*, BenchParams, TraceStats*);
+
+// a grid of many small lenses, to see how tracing scales with the element count.
+struct LensField {
+  std::vector<SDF *> lenses;
+  SDFTape tape; // every lens, one after the other.
+  SDFBVH bvh;
+};
+
+// both field rows march, so they compare the tape and the BVH on the same
+// distance queries; jumping between crossings would skip the tape entirely.
+struct LensFieldStep {
+  static constexpr int NSTEPS = 200;
+  static constexpr float MIN_TRACE_DIST = 1;
+  static constexpr bool ANALYTIC = false;
+  static float rayLength(float dist) {
+    return std::max<float>(fabs(dist) * 0.9, MIN_TRACE_DIST);
+  }
+};
+
+static void *lensField_init(BenchParams params) {
+  LensField *field = new LensField;
+  const int NX = 16, NY = 16;
+  SDF *all = nullptr;
+  for(int i = 0; i < NX; ++i) {
+    for(int j = 0; j < NY; ++j) {
+      const Vector2 c = v2((i + 0.5) * params.screenWidth / NX, (j + 0.5) * params.screenHeight / NY);
+      const float r = 100, thickness = 10;
+      SDF *lens = new SDFIntersect(new SDFCircle(v2(c.x - r + thickness, c.y), r),
+          new SDFCircle(v2(c.x + r - thickness, c.y), r));
+      field->lenses.push_back(lens);
+      all = all ? new SDFUnion(all, lens) : lens;
+    }
+  }
+  field->tape.compile(all);
+  field->bvh.build(field->lenses);
+  return field;
+}
+
+static void lensField_trace(SDF *glass, BenchParams params, TraceStats *stats) {
+  Scene s; s.glassSDF = glass; s.draw = false; s.stats = stats;
+  NoRecord record;
+  NoDraw sink;
+  const int NRAYS = 360;
+  for(int i = 0; i < NRAYS; ++i) {
+    const float theta = (M_PI * 2) * i / NRAYS;
+    raymarch<LensFieldStep>(s, params.source, v2(cos(theta), sin(theta)),
+        v2(0, 0), v2(params.screenWidth, params.screenHeight), record, sink);
+  }
+}
+
+static void lensField_benchTape(void *data, BenchParams params, TraceStats *stats) {
+  lensField_trace(&((LensField *)data)->tape, params, stats);
+}
+
+static void lensField_benchBVH(void *data, BenchParams params, TraceStats *stats) {
+  lensField_trace(&((LensField *)data)->bvh, params, stats);
+}
+
+#define NSCENES 5
+#define NBENCHES 19
+int main(int argc, char **argv) {
+    const int nframes = argc > 1 ? atoi(argv[1]) : 10;
+
+    BenchParams params;
+    params.screenWidth = 1920;
+    params.screenHeight = 1080;
+    params.source = v2(params.screenWidth / 10, params.screenHeight / 2);
+    params.lensThickness = 100;
+    params.apertureHalfOpeningHeight = 60;
+
+    // the scenes, then the lens field.
+    void *scene_data[NSCENES + 1] = {sceneA_init(), sceneB_init(), sceneC_init(), sceneD_init(), sceneF_init(),
+      lensField_init(params) };
+    // A marches on an expression-template lens (sdfexpr.h); B, C and
+    // field/tape on an SDFTape (B/grid on a grid sampled from one). D and F
+    // jump between closed-form crossings instead.
+    const char *names[NBENCHES] = { "A", "B", "C", "D", "F", "B/grid", "D/packet", "F/packet",
+      "D/wavefront", "F/wavefront", "D/spectral",
+      "A/adaptive", "B/adaptive", "D/adaptive", "F/adaptive", "D/cone", "F/cone", "field/tape", "field/bvh" };
+    int bench2Scene[NBENCHES] = { 0, 1, 2, 3, 4, 1, 3, 4, 3, 4, 3, 0, 1, 3, 4, 3, 4, NSCENES, NSCENES };
+    std::function<void(void*, BenchParams, TraceStats*)> bench_fns[NBENCHES] =
+      { sceneA_bench, sceneB_bench, sceneC_bench, sceneD_bench, sceneF_bench,
+        sceneB_benchGrid, sceneD_benchPacket, sceneF_benchPacket,
+        sceneD_benchWavefront, sceneF_benchWavefront, sceneD_benchSpectral,
+        sceneA_benchAdaptive, sceneB_benchAdaptive, sceneD_benchAdaptive, sceneF_benchAdaptive, sceneD_benchCone, sceneF_benchCone, lensField_benchTape, lensField_benchBVH };
+
+    printf("%d frames at %dx%d\n", nframes, params.screenWidth, params.screenHeight);
+    for(int bench = 0; bench < NBENCHES; ++bench) {
+      void *data = scene_data[bench2Scene[bench]];
+      // warm up caches and lazily built state before timing.
+      TraceStats warmup;
+      bench_fns[bench](data, params, &warmup);
+
+      TraceStats stats;
+      auto start = std::chrono::steady_clock::now();
+      for(int frame = 0; frame < nframes; ++frame) {
+        bench_fns[bench](data, params, &stats);
+      }
+      auto end = std::chrono::steady_clock::now();
+      const double seconds = std::chrono::duration<double>(end - start).count();
+      const double nrays = std::max<double>(1, stats.nrays);
+
+      printf("scene%-9s %10lld rays  %12.0f rays/s  %12.0f detected/s  %8.2f steps/ray  %8.2f sdf evals/ray  %8.3f ms/frame\n",
+          names[bench], stats.nrays, stats.nrays / seconds, stats.ndetected / seconds,
+          stats.nsteps / nrays, stats.nsdfEvals / nrays,
+          1000.0 * seconds / nframes);
+    }
+    return 0;
+}
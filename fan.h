@@ -0,0 +1,149 @@
+#pragma once
+// adaptive angular sampling of a ray fan.
+//
+// A uniform fan spends most of its rays on directions that miss everything
+// and too few where the lens folds rays together. adaptiveFan starts from a
+// coarse uniform fan and bisects every angular interval whose two end rays
+// disagree: they ended on different things, left in directions that differ
+// by more than a tolerance, or landed too far apart. Bisection stops at the
+// tolerance or at a minimum interval width.
+//
+// Every sample carries the angle it stands for (weight), so quantities
+// accumulated from the fan, such as a sensor image, keep the density of a
+// uniform fan.
+//
+// When only rays through an aperture opening matter, apertureCone and coneFan
+// restrict the fan to the directions that can get through.
+#include "raymarch.h"
+#include <float.h>
+#include <vector>
+
+struct FanSample {
+  float theta = 0;
+  // what the ray ended on; neighbours with different outcomes are always split.
+  int outcome = 0;
+  // exit direction minus launch direction, in radians.
+  float deflection = 0;
+  // where the ray ended, along whatever the caller measures; compared between equal outcomes.
+  float position = 0;
+  // the caller's handle on the traced ray.
+  int id = -1;
+  // angle the sample stands for, filled in by adaptiveFan.
+  float weight = 0;
+};
+
+struct FanTolerance {
+  float deflection = 0.01;
+  float position = FLT_MAX;
+  float minAngle = 1e-3; // intervals narrower than this are not split.
+  int maxSamples = 1 << 16;
+};
+
+static inline float fanAngleDiff(float a, float b) {
+  return atan2f(sinf(a - b), cosf(a - b));
+}
+
+static inline bool fanDisagree(const FanSample &a, const FanSample &b, const FanTolerance &tol) {
+  if (a.outcome != b.outcome) { return true; }
+  if (fabs(fanAngleDiff(a.deflection, b.deflection)) > tol.deflection) { return true; }
+  return fabs(a.position - b.position) > tol.position;
+}
+
+template<typename Trace>
+static void adaptiveFanSplit(const FanSample &a, const FanSample &b, const FanTolerance &tol,
+    Trace &trace, std::vector<FanSample> &out) {
+  if ((int)out.size() >= tol.maxSamples || b.theta - a.theta < 2 * tol.minAngle || !fanDisagree(a, b, tol)) {
+    return;
+  }
+  const FanSample mid = trace(0.5f * (a.theta + b.theta));
+  adaptiveFanSplit(a, mid, tol, trace, out);
+  out.push_back(mid);
+  adaptiveFanSplit(mid, b, tol, trace, out);
+}
+
+// sample [theta0, theta1] with ncoarse + 1 uniform rays, then refine.
+// trace(theta) traces one ray and returns its FanSample; out is sorted by theta.
+template<typename Trace>
+static void adaptiveFan(float theta0, float theta1, int ncoarse, const FanTolerance &tol,
+    Trace trace, std::vector<FanSample> &out) {
+  out.clear();
+  FanSample prev = trace(theta0);
+  out.push_back(prev);
+  for(int i = 1; i <= ncoarse; ++i) {
+    const FanSample cur = trace(theta0 + (theta1 - theta0) * i / ncoarse);
+    adaptiveFanSplit(prev, cur, tol, trace, out);
+    out.push_back(cur);
+    prev = cur;
+  }
+
+  // each sample stands for half of the gap on either side; the ends for the whole gap.
+  const int n = out.size();
+  for(int i = 0; i < n; ++i) {
+    const float left = i > 0 ? out[i].theta - out[i - 1].theta : 0;
+    const float right = i + 1 < n ? out[i + 1].theta - out[i].theta : 0;
+    out[i].weight = i == 0 ? right : i == n - 1 ? left : 0.5f * (left + right);
+  }
+}
+
+// directions from source that pass through the opening of a slab aperture,
+// the strip x0 <= x <= x1 blocked everywhere but y0 < y < y1, for a source
+// left of the slab. A ray must enter and leave the opening, so the interval
+// is the intersection of the ones through its front and back faces. Returns
+// false when source is not left of the slab.
+static inline bool apertureCone(Vector2 source, float x0, float x1, float y0, float y1,
+    float &theta0, float &theta1) {
+  if (source.x >= x0) { return false; }
+  const float near = x0 - source.x, far = x1 - source.x;
+  theta0 = std::max<float>(atan2f(y0 - source.y, near), atan2f(y0 - source.y, far));
+  theta1 = std::min<float>(atan2f(y1 - source.y, near), atan2f(y1 - source.y, far));
+  // a closed (or too thin) opening lets nothing through.
+  if (theta1 < theta0) { theta1 = theta0; }
+  return true;
+}
+
+// ceil(width * raysPerRadian) directions, stratified over [theta0, theta1] and
+// appended to out with the given id. Each stands for an equal share of the width.
+static inline void coneFan(float theta0, float theta1, float raysPerRadian, int id, std::vector<FanSample> &out) {
+  const float width = theta1 - theta0;
+  if (width <= 0) { return; }
+  const int n = std::max<int>(1, ceilf(width * raysPerRadian));
+  for(int k = 0; k < n; ++k) {
+    FanSample sample;
+    sample.theta = theta0 + width * (k + 0.5f) / n;
+    sample.weight = width / n;
+    sample.id = id;
+    out.push_back(sample);
+  }
+}
+
+// recorder that fills in a FanSample for the scalar marcher.
+struct FanRecord : public NoRecord {
+  Vector2 prev = v2(0, 0), last = v2(0, 0);
+  int npoints = 0;
+  int ninterfaces = 0;
+  bool opaque = false, detected = false;
+
+  void onPoint(Vector2 point) { push(point); }
+  void onEnd(Vector2 point) { push(point); }
+  void onInterface(Vector2 point) { ninterfaces++; }
+  void onOpaque() { opaque = true; }
+  void onDetect(int element) { detected = true; }
+
+  void push(Vector2 point) {
+    if (npoints > 0 && Vector2Equals(point, last)) { return; }
+    prev = last;
+    last = point;
+    npoints++;
+  }
+
+  FanSample sample(float theta) const {
+    FanSample s;
+    s.theta = theta;
+    s.outcome = ninterfaces * 4 + (opaque ? 1 : 0) + (detected ? 2 : 0);
+    if (npoints >= 2) {
+      const Vector2 d = Vector2Subtract(last, prev);
+      s.deflection = fanAngleDiff(atan2f(d.y, d.x), theta);
+    }
+    return s;
+  }
+};
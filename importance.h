@@ -0,0 +1,77 @@
+#pragma once
+// binned angular importance, for importance sampling ray directions.
+//
+// Every traced direction records its importance in one of a fixed number of
+// bins over [0, 2pi). rebuild() turns the per-bin mean importance into a CDF
+// that sample() / pdf() draw from, mixed with a uniform floor so directions
+// that looked unimportant keep being explored. Memory and per-sample cost are
+// constant no matter how long the sampler runs.
+#include "optics.h"
+#include <algorithm>
+
+static const int ANGULAR_HISTOGRAM_BINS = 360;
+
+struct AngularHistogram {
+  float sum[ANGULAR_HISTOGRAM_BINS];
+  int count[ANGULAR_HISTOGRAM_BINS];
+  // cdf[i] is the probability of a bin below i, cdf[BINS] = 1.
+  float cdf[ANGULAR_HISTOGRAM_BINS + 1];
+  // probability of drawing uniformly instead of from the histogram.
+  float uniformFraction = 0.1;
+
+  AngularHistogram() { clear(); }
+
+  void clear() {
+    std::fill(sum, sum + ANGULAR_HISTOGRAM_BINS, 0.0f);
+    std::fill(count, count + ANGULAR_HISTOGRAM_BINS, 0);
+    rebuild();
+  }
+
+  static float binWidth() { return 2 * M_PI / ANGULAR_HISTOGRAM_BINS; }
+
+  static int bin(float theta) {
+    theta = fmodf(theta, 2 * M_PI);
+    if (theta < 0) { theta += 2 * M_PI; }
+    return std::min<int>(ANGULAR_HISTOGRAM_BINS - 1, theta / binWidth());
+  }
+
+  void record(float theta, float importance) {
+    const int b = bin(theta);
+    sum[b] += importance;
+    count[b]++;
+  }
+
+  // refresh the CDF from the recorded importance. Bins nothing landed in yet
+  // get the mean of the others.
+  void rebuild() {
+    float total = 0;
+    int nseen = 0;
+    for(int b = 0; b < ANGULAR_HISTOGRAM_BINS; ++b) {
+      if (count[b]) { total += sum[b] / count[b]; nseen++; }
+    }
+    const float prior = nseen ? total / nseen : 1;
+    cdf[0] = 0;
+    for(int b = 0; b < ANGULAR_HISTOGRAM_BINS; ++b) {
+      const float w = count[b] ? sum[b] / count[b] : prior;
+      cdf[b + 1] = cdf[b] + std::max<float>(w, 0);
+    }
+    const float norm = cdf[ANGULAR_HISTOGRAM_BINS];
+    for(int b = 1; b <= ANGULAR_HISTOGRAM_BINS; ++b) {
+      cdf[b] = norm > 0 ? cdf[b] / norm : float(b) / ANGULAR_HISTOGRAM_BINS;
+    }
+  }
+
+  // draw a direction from uniforms u, v, w in [0, 1).
+  float sample(float u, float v, float w) const {
+    if (u < uniformFraction) { return 2 * M_PI * v; }
+    const int b = std::upper_bound(cdf + 1, cdf + ANGULAR_HISTOGRAM_BINS + 1, v) - (cdf + 1);
+    return (std::min<int>(b, ANGULAR_HISTOGRAM_BINS - 1) + w) * binWidth();
+  }
+
+  // density of sample() at theta, per radian.
+  float pdf(float theta) const {
+    const int b = bin(theta);
+    return (1 - uniformFraction) * (cdf[b + 1] - cdf[b]) / binWidth() +
+      uniformFraction / (2 * M_PI);
+  }
+};
@@ -0,0 +1,374 @@
+#pragma once
+// the lens, aperture and screen that scenes D and F are built from, and the
+// ways they trace their ray fans.
+//
+// A scene keeps its state in a LensSceneData and describes its fan with a
+// LensFan: npoints source points stacked along y, ndirs + 1 directions from
+// each. The tracing functions take the scene's Step policy (a LensStep) as a
+// template parameter; the batch tracers read their step constants from it
+// too. Rays traced with the scalar marcher keep their paths in data->results
+// for the scene to draw; every mode fills the sensor.
+#include "raymarch.h"
+#include "packet.h"
+#include "threadpool.h"
+#include "linebatch.h"
+#include "patharena.h"
+#include "sensor.h"
+#include "wavefront.h"
+#include "fan.h"
+
+// how the scenes step their rays, up to MaxSteps of them.
+template<int MaxSteps>
+struct LensStep {
+  // every element has a closed-form crossing: jump between them instead of marching.
+  static constexpr bool ANALYTIC = true;
+  static constexpr int NSTEPS = MaxSteps;
+  // crossings are refined onto the surface, so the floor only has to stay
+  // below the aperture's width.
+  static constexpr float MIN_TRACE_DIST = 1;
+  static constexpr float MAX_TRACE_DIST = 10000;
+  static constexpr float STEP_FACTOR = 0.9;
+  static float rayLength(float dist) {
+    dist = std::min<float>(MAX_TRACE_DIST, fabs(dist));
+    return std::max<float>(dist * STEP_FACTOR, MIN_TRACE_DIST);
+  }
+};
+
+struct LensRaytraceResult : public InterfacePathRecord {
+  bool totalInternalReflected = false;
+  bool refracted = false;
+  bool intersectedAperture = false;
+  Color rayColor;
+  bool intersectedScreen = false;
+
+  void onRefract() { refracted = true; }
+  void onTotalInternalReflection() { totalInternalReflected = true; }
+  // the aperture is the scene's only opaque element, the screen its only detector.
+  void onOpaque() { intersectedAperture = true; }
+  void onDetect(int element) { intersectedScreen = true; }
+};
+
+// the fan traced from the source: npoints points stacked along y, ndirs + 1 directions from each.
+struct LensFan {
+  int npoints;
+  int ndirs;
+  float halfHeight; // the points span source.y +- halfHeight.
+  unsigned char alpha; // of the ray colors.
+
+  int nrays() const { return npoints * (ndirs + 1); }
+  // rays per radian of the uniform fan, what cone and adaptive hits are weighted against.
+  float raysPerRadian() const { return ndirs / (M_PI * 2.0); }
+
+  Vector2 start(Vector2 source, int i) const {
+    const float y = source.y + (float(i - npoints/2) / (npoints/2)) * halfHeight;
+    return v2(source.x, y);
+  }
+
+  float theta(int j) const { return (M_PI * 2.0) * ((float)j / (float)ndirs); }
+
+  // wavelength (nm) of the rays from point i: the points run from violet to
+  // red, like their colors.
+  float wavelength(int i) const {
+    return WAVELENGTH_MIN + (WAVELENGTH_MAX - WAVELENGTH_MIN) * (i + 0.5f) / npoints;
+  }
+
+  Color color(int i) const {
+    const unsigned char r = (float(i) / float(npoints)) * 255;
+    const unsigned char g = fabs(2 * (0.5 - float(i))) / float(npoints) * 255;
+    const unsigned char b = (1.0 - float(i) / float(npoints)) * 255;
+    return {r, g, b, alpha};
+  }
+};
+
+struct LensSceneData {
+  SDFLens lensShape; // the lens, for every tracer.
+  float lensRadius;
+  float lensThickness;
+  Vector2 lensCenter;
+  ApertureData apertureData;
+  ScreenData screenData;
+  SceneElement elements[3]; // lens, aperture, screen: what the tracer sees.
+  SDFBVH elementBVH; // over elements, rebuilt on layout.
+  FanTracer tracer; // what traces the uniform and cone fans.
+  std::vector<WavefrontQueue> wavefronts; // scratch per participant, for the wavefront tracer.
+  bool adaptive; // refine a coarse fan per source point instead of shooting ndirs rays.
+  std::vector<std::vector<LensRaytraceResult>> fanResults; // per source point, in trace order.
+  std::vector<std::vector<FanSample>> fanSamples; // per source point, by angle.
+  std::vector<FanSample> batchRays; // this frame's directions for the batch tracers, id = source point.
+  bool cone; // only shoot the directions that get through the aperture's opening.
+  std::vector<FanSample> coneRays; // this frame's directions in cone mode, id = source point.
+  std::vector<LensRaytraceResult> results; // per ray, reused across frames.
+  PathArena paths; // points of every ray in results, reset every frame.
+  Sensor sensor; // where rays land on the screen, this frame.
+  LineBatch rayLines; // ray paths, reused across frames.
+};
+
+static inline void lensSceneInit(LensSceneData *data, OpticMaterial glass) {
+  data->lensRadius = 10000;
+  data->lensThickness = 100;
+  data->lensCenter = v2(0, 0);
+  data->apertureData.halfOpeningHeight = 0;
+  data->apertureData.x = 0;
+  data->tracer = FanTracer::Scalar;
+  data->adaptive = false;
+  data->cone = false;
+  data->elements[0] = SceneElement{&data->lensShape, glass};
+  data->elements[1] = SceneElement{&data->apertureData, OpticMaterial(OpticMaterialKind::Opaque, 0)};
+  data->elements[2] = SceneElement{&data->screenData, OpticMaterial(OpticMaterialKind::Detector, 0)};
+}
+
+// the elements, as the marcher sees them.
+static inline Scene lensScene(LensSceneData *data) {
+  Scene s;
+  s.elements = data->elements;
+  s.nelements = 3;
+  s.bvh = &data->elementBVH;
+  return s;
+}
+
+static inline void drawScreen(ScreenData screenData) {
+  Color color {128, 128, 128, 50};
+  DrawLineEx(v2(screenData.x, screenData.y - screenData.halfHeight),
+      v2(screenData.x, screenData.y + screenData.halfHeight),
+      screenData.halfWidth * 2, color);
+}
+
+static inline void drawAperture(ApertureData apertureData) {
+  Color color {160, 147, 125, 255};
+  DrawLineEx(v2(apertureData.x, 0),
+      v2(apertureData.x, apertureData.y - apertureData.halfOpeningHeight),
+      apertureData.halfWidth, color);
+
+  DrawLineEx(v2(apertureData.x, apertureData.y + apertureData.halfOpeningHeight),
+      v2(apertureData.x, GetScreenHeight()),
+      apertureData.halfWidth, color);
+}
+
+template<typename Step>
+static LensRaytraceResult lensRaytrace(Scene s,
+    PathArena &arena, int region,
+    Color rayColor,
+    Vector2 start, Vector2 dir, Vector2 bottomLeft, Vector2 topRight) {
+  LensRaytraceResult result;
+  result.begin(arena, region);
+  result.rayColor = rayColor;
+  NoDraw sink;
+  raymarch<Step>(s, start, dir, bottomLeft, topRight, result, sink);
+  return result;
+}
+
+template<typename Step>
+static PacketStep lensPacketStep() {
+  return { Step::NSTEPS, Step::STEP_FACTOR, Step::MIN_TRACE_DIST, Step::MAX_TRACE_DIST };
+}
+
+static inline PacketScene lensPacketScene(const LensSceneData *data, int screenWidth, int screenHeight) {
+  PacketScene ps;
+  ps.setLens(data->lensShape);
+  ps.hasAperture = true;
+  ps.apertureX = data->apertureData.x;
+  ps.apertureY = data->apertureData.y;
+  ps.apertureHalfWidth = data->apertureData.halfWidth;
+  ps.apertureHalfOpeningHeight = data->apertureData.halfOpeningHeight;
+  ps.hasScreen = true;
+  ps.screenX = data->screenData.x;
+  ps.screenY = data->screenData.y;
+  ps.screenHalfWidth = data->screenData.halfWidth;
+  ps.screenHalfHeight = data->screenData.halfHeight;
+  ps.bottomLeft = v2(0, 0);
+  ps.topRight = v2(screenWidth, screenHeight);
+  return ps;
+}
+
+// this frame's paths and sensor, empty. The sensor spans the screen.
+static inline void lensTraceBegin(LensSceneData *data) {
+  data->paths.reset(threadPool().nparticipants());
+  data->sensor.begin(data->screenData.y - data->screenData.halfHeight,
+      2 * data->screenData.halfHeight, threadPool().nparticipants());
+}
+
+// the uniform fan as FanSamples, each standing for its share of the circle.
+static inline void lensUniformRays(const LensFan &fan, std::vector<FanSample> &rays) {
+  rays.resize(fan.nrays());
+  for(int k = 0; k < fan.nrays(); ++k) {
+    rays[k].id = k / (fan.ndirs + 1);
+    rays[k].theta = fan.theta(k % (fan.ndirs + 1));
+    rays[k].weight = (M_PI * 2.0) / fan.ndirs;
+  }
+}
+
+// each source point's fan cut down to the aperture's opening, at the density
+// of the uniform fan. The lens and screen are behind the aperture, so no
+// other direction can reach the screen.
+static inline void lensConeRays(const LensSceneData *data, const LensFan &fan, Vector2 source,
+    std::vector<FanSample> &rays) {
+  const ApertureData &ap = data->apertureData;
+  rays.clear();
+  for(int i = 0; i < fan.npoints; ++i) {
+    float theta0 = 0, theta1 = M_PI * 2.0;
+    apertureCone(fan.start(source, i), ap.x - ap.halfWidth, ap.x + ap.halfWidth,
+        ap.y - ap.halfOpeningHeight, ap.y + ap.halfOpeningHeight, theta0, theta1);
+    coneFan(theta0, theta1, fan.raysPerRadian(), i, rays);
+  }
+}
+
+// every (source, direction) pair of the uniform fan across the pool, each into its own slot.
+template<typename Step>
+static void lensTraceUniform(LensSceneData *data, const LensFan &fan, Scene s, Vector2 source,
+    int screenWidth, int screenHeight) {
+  std::vector<LensRaytraceResult> &results = data->results;
+  results.resize(fan.nrays());
+  parallelTrace(s, results.size(), 64, [&](Scene ws, int k, int participant) {
+    const int i = k / (fan.ndirs + 1);
+    const float theta = fan.theta(k % (fan.ndirs + 1));
+    ws.wavelength = fan.wavelength(i);
+    results[k] = lensRaytrace<Step>(ws, data->paths, participant, fan.color(i),
+        fan.start(source, i), v2(cos(theta), sin(theta)), v2(0, 0), v2(screenWidth, screenHeight));
+    if (results[k].intersectedScreen) {
+      data->sensor.record(participant, data->paths.last(results[k].path).y, results[k].rayColor);
+    }
+  });
+}
+
+// the cone fan (lensConeRays) with the scalar marcher.
+template<typename Step>
+static void lensTraceCone(LensSceneData *data, const LensFan &fan, Scene s, Vector2 source,
+    int screenWidth, int screenHeight) {
+  const float raysPerRadian = fan.raysPerRadian();
+  std::vector<FanSample> &rays = data->coneRays;
+  lensConeRays(data, fan, source, rays);
+
+  std::vector<LensRaytraceResult> &results = data->results;
+  results.resize(rays.size());
+  parallelTrace(s, rays.size(), 64, [&](Scene ws, int k, int participant) {
+    const FanSample &ray = rays[k];
+    ws.wavelength = fan.wavelength(ray.id);
+    results[k] = lensRaytrace<Step>(ws, data->paths, participant, fan.color(ray.id),
+        fan.start(source, ray.id), v2(cos(ray.theta), sin(ray.theta)), v2(0, 0), v2(screenWidth, screenHeight));
+    if (results[k].intersectedScreen) {
+      data->sensor.record(participant, data->paths.last(results[k].path).y, results[k].rayColor,
+          ray.weight * raysPerRadian);
+    }
+  });
+}
+
+// the rays (id = source point) through data->tracer instead of the scalar
+// marcher. Hits only land on the sensor: the batch tracers keep no paths to draw.
+template<typename Step>
+static void lensTraceBatch(LensSceneData *data, const LensFan &fan, Scene s, const std::vector<FanSample> &rays,
+    Vector2 source, int screenWidth, int screenHeight) {
+  const PacketScene ps = lensPacketScene(data, screenWidth, screenHeight);
+  const PacketStep step = lensPacketStep<Step>();
+  const float raysPerRadian = fan.raysPerRadian();
+  const OpticMaterial &glass = data->elements[0].material;
+  data->wavefronts.resize(threadPool().nparticipants());
+
+  const int GROUP = 512; // rays per task.
+  const int nrays = rays.size();
+  const int ngroups = (nrays + GROUP - 1) / GROUP;
+  parallelTrace(s, ngroups, 1, [&](Scene ws, int g, int participant) {
+    Vector2 starts[GROUP], dirs[GROUP];
+    float indices[GROUP];
+    PacketRayResult out[GROUP];
+    const int first = g * GROUP;
+    const int n = std::min<int>(GROUP, nrays - first);
+    for(int r = 0; r < n; ++r) {
+      starts[r] = fan.start(source, rays[first + r].id);
+      dirs[r] = v2(cos(rays[first + r].theta), sin(rays[first + r].theta));
+      indices[r] = glass.indexAt(fan.wavelength(rays[first + r].id));
+    }
+    traceBatch(data->tracer, ps, step, starts, dirs, n, out, ws.stats, data->wavefronts[participant], indices);
+    for(int r = 0; r < n; ++r) {
+      if (!out[r].intersectedScreen) { continue; }
+      const FanSample &ray = rays[first + r];
+      data->sensor.record(participant, out[r].point.y, fan.color(ray.id), ray.weight * raysPerRadian);
+    }
+  });
+}
+
+// what a traced ray tells the adaptive fan.
+static inline FanSample lensFanSample(const LensSceneData *data, const LensRaytraceResult &result, float theta) {
+  FanSample sample;
+  sample.theta = theta;
+  sample.outcome = (result.intersectedScreen ? 1 : 0) | (result.intersectedAperture ? 2 : 0) |
+    (result.refracted ? 4 : 0) | (result.totalInternalReflected ? 8 : 0);
+  const Vector2 *points = data->paths.points(result.path);
+  const int n = result.path.count;
+  if (n >= 2) {
+    const Vector2 d = Vector2Subtract(points[n - 1], points[n - 2]);
+    sample.deflection = fanAngleDiff(atan2f(d.y, d.x), theta);
+  }
+  if (result.intersectedScreen) { sample.position = points[n - 1].y; }
+  return sample;
+}
+
+// an adaptive fan from each source point, with the scalar marcher. Its
+// samples are left in data->fanSamples and its rays in data->results. When
+// detect is set, hits land on the sensor weighted by the angle their ray
+// stands for, in units of the uniform fan's spacing.
+template<typename Step>
+static void lensTraceAdaptive(LensSceneData *data, const LensFan &fan, Scene s, Vector2 source,
+    int screenWidth, int screenHeight, bool detect) {
+  FanTolerance tol;
+  tol.deflection = 0.02;
+  tol.position = 4;
+  tol.minAngle = (M_PI * 2.0) / (fan.ndirs * 2);
+  const float raysPerRadian = fan.raysPerRadian();
+
+  data->fanResults.resize(fan.npoints);
+  data->fanSamples.resize(fan.npoints);
+  parallelTrace(s, fan.npoints, 1, [&](Scene ws, int i, int participant) {
+    std::vector<LensRaytraceResult> &results = data->fanResults[i];
+    std::vector<FanSample> &samples = data->fanSamples[i];
+    results.clear();
+    const Vector2 rayLoc = fan.start(source, i);
+    const Color rayColor = fan.color(i);
+    ws.wavelength = fan.wavelength(i);
+    adaptiveFan(0, M_PI * 2.0, fan.ndirs / 8, tol, [&](float theta) {
+      results.push_back(lensRaytrace<Step>(ws, data->paths, participant, rayColor,
+          rayLoc, v2(cos(theta), sin(theta)), v2(0, 0), v2(screenWidth, screenHeight)));
+      FanSample sample = lensFanSample(data, results.back(), theta);
+      sample.id = results.size() - 1;
+      return sample;
+    }, samples);
+    if (!detect) { return; }
+    for(const FanSample &sample : samples) {
+      const LensRaytraceResult &result = results[sample.id];
+      if (!result.intersectedScreen) { continue; }
+      data->sensor.record(participant, sample.position, result.rayColor, sample.weight * raysPerRadian);
+    }
+  });
+  data->results.clear();
+  for(const std::vector<LensRaytraceResult> &results : data->fanResults) {
+    data->results.insert(data->results.end(), results.begin(), results.end());
+  }
+}
+
+// the fan from source in the mode data selects, onto the sensor.
+template<typename Step>
+static void lensTraceFan(LensSceneData *data, const LensFan &fan, Scene s, Vector2 source,
+    int screenWidth, int screenHeight) {
+  if (data->adaptive) {
+    // picks its directions with scalar rays, so traces them all that way.
+    lensTraceAdaptive<Step>(data, fan, s, source, screenWidth, screenHeight, true);
+  } else if (data->tracer != FanTracer::Scalar) {
+    std::vector<FanSample> &rays = data->batchRays;
+    data->results.clear();
+    if (data->cone) { lensConeRays(data, fan, source, rays); } else { lensUniformRays(fan, rays); }
+    lensTraceBatch<Step>(data, fan, s, rays, source, screenWidth, screenHeight);
+  } else if (data->cone) {
+    lensTraceCone<Step>(data, fan, s, source, screenWidth, screenHeight);
+  } else {
+    lensTraceUniform<Step>(data, fan, s, source, screenWidth, screenHeight);
+  }
+}
+
+// bench with flag set to value, then put it back.
+template<typename T>
+static void lensBenchWith(T &flag, T value, void (*bench)(void *, BenchParams, TraceStats *),
+    void *raw_data, BenchParams params, TraceStats *stats) {
+  const T old = flag;
+  flag = value;
+  bench(raw_data, params, stats);
+  flag = old;
+}
@@ -0,0 +1,75 @@
+#pragma once
+// batched thick-line rendering.
+//
+// DrawLineEx pushes every segment through its own call. LineBatch instead
+// collects the quads of all segments of a frame into one vertex buffer, with a
+// color per vertex, and submits them to rlgl in large chunks, so rlgl flushes
+// a handful of draw calls per frame. Keep the batch around and clear() it at
+// the start of each frame to reuse its storage.
+#include "optics.h"
+#include "rlgl.h"
+#include <vector>
+
+struct LineBatchVertex {
+  Vector2 pos;
+  Color color;
+};
+
+// segments per rlBegin / rlEnd, well under rlgl's default batch size.
+static const int LINE_BATCH_CHUNK = 1024;
+
+struct LineBatch {
+  // 4 vertices per segment, in DrawLineEx's triangle strip order.
+  std::vector<LineBatchVertex> vertices;
+
+  void clear() { vertices.clear(); }
+  int nsegments() const { return vertices.size() / 4; }
+
+  // the quad DrawLineEx would draw.
+  void segment(Vector2 start, Vector2 end, float thickness, Color color) {
+    const Vector2 delta = Vector2Subtract(end, start);
+    const float length = Vector2Length(delta);
+    if (length <= 0 || thickness <= 0) { return; }
+    const float scale = thickness / (2 * length);
+    const Vector2 radius = v2(-scale * delta.y, scale * delta.x);
+    vertices.push_back({Vector2Subtract(start, radius), color});
+    vertices.push_back({Vector2Add(start, radius), color});
+    vertices.push_back({Vector2Subtract(end, radius), color});
+    vertices.push_back({Vector2Add(end, radius), color});
+  }
+
+  void polyline(const Vector2 *points, int count, float thickness, Color color) {
+    for(int i = 0; i + 1 < count; ++i) {
+      segment(points[i], points[i + 1], thickness, color);
+    }
+  }
+
+  void polyline(const std::vector<Vector2> &points, float thickness, Color color) {
+    polyline(points.data(), points.size(), thickness, color);
+  }
+
+  // submit everything; call between BeginDrawing / EndDrawing.
+  void draw() const {
+    const int n = nsegments();
+    const LineBatchVertex *v = vertices.data();
+    rlSetTexture(0);
+    for(int begin = 0; begin < n; begin += LINE_BATCH_CHUNK) {
+      const int end = std::min<int>(n, begin + LINE_BATCH_CHUNK);
+      rlCheckRenderBatchLimit(6 * (end - begin));
+      rlBegin(RL_TRIANGLES);
+      for(int i = begin; i < end; ++i) {
+        const LineBatchVertex *q = v + 4 * i;
+        // (2, 0, 1), (3, 2, 1): the two triangles DrawTriangleStrip emits.
+        emit(q[2]); emit(q[0]); emit(q[1]);
+        emit(q[3]); emit(q[2]); emit(q[1]);
+      }
+      rlEnd();
+    }
+  }
+
+private:
+  static void emit(const LineBatchVertex &v) {
+    rlColor4ub(v.color.r, v.color.g, v.color.b, v.color.a);
+    rlVertex2f(v.pos.x, v.pos.y);
+  }
+};
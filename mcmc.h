@@ -0,0 +1,97 @@
+#pragma once
+// building blocks for Metropolis-Hastings with parallel tempering.
+//
+// Each TemperedChain carries its own RNG so chains can step on different
+// threads without sharing rand() state. A chain at temperature T targets
+// importance^(1/T); hot chains roam, and exchangeReplicas lets their states
+// migrate down to the T = 1 chain whose samples are used. Chains append what
+// they want drawn to a PathBuffer, which only needs atomic counters.
+#include "optics.h"
+#include <atomic>
+#include <vector>
+
+// pcg32, one stream per chain.
+struct ChainRng {
+  unsigned long long state = 0;
+  unsigned long long inc = 1;
+
+  ChainRng() {};
+  ChainRng(unsigned long long seed, unsigned long long stream) {
+    inc = (stream << 1u) | 1u;
+    next();
+    state += seed;
+    next();
+  }
+
+  unsigned int next() {
+    const unsigned long long old = state;
+    state = old * 6364136223846793005ULL + inc;
+    const unsigned int xorshifted = ((old >> 18u) ^ old) >> 27u;
+    const unsigned int rot = old >> 59u;
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+  }
+
+  // uniform in [0, 1).
+  float uniform() { return (next() >> 8) * (1.0f / 16777216.0f); }
+};
+
+struct TemperedChain {
+  float theta = 0;
+  float importance = 1e-3;
+  float temperature = 1;
+  ChainRng rng;
+};
+
+// probability of moving from importance cur to next at temperature T.
+static float metropolisAcceptance(float next, float cur, float temperature, float proposalRatio) {
+  if (cur <= 0) { return 1; }
+  return powf(next / cur, 1.0f / temperature) * proposalRatio;
+}
+
+// replica exchange between two chains, swapping their states (not temperatures).
+static bool exchangeReplicas(TemperedChain &a, TemperedChain &b, float u) {
+  if (a.importance <= 0 || b.importance <= 0) { return false; }
+  const float logRatio = (logf(b.importance) - logf(a.importance)) *
+    (1.0f / a.temperature - 1.0f / b.temperature);
+  if (logf(std::max<float>(u, 1e-30)) >= logRatio) { return false; }
+  std::swap(a.theta, b.theta);
+  std::swap(a.importance, b.importance);
+  return true;
+}
+
+// fixed capacity polylines appended from many threads at once. Writers
+// reserve their slot and their vertices with one atomic add each; readers run
+// after the writers are joined. Paths that do not fit are dropped.
+struct PathBuffer {
+  struct Path {
+    int offset;
+    int count;
+  };
+
+  std::vector<Path> paths;
+  std::vector<Vector2> vertices;
+  std::atomic<int> npaths{0};
+  std::atomic<int> nvertices{0};
+
+  void reserve(int maxPaths, int maxVertices) {
+    paths.resize(maxPaths);
+    vertices.resize(maxVertices);
+  }
+
+  void clear() {
+    npaths = 0;
+    nvertices = 0;
+  }
+
+  bool push(const Vector2 *points, int count) {
+    const int offset = nvertices.fetch_add(count, std::memory_order_relaxed);
+    if (offset + count > (int)vertices.size()) { return false; }
+    const int ix = npaths.fetch_add(1, std::memory_order_relaxed);
+    if (ix >= (int)paths.size()) { return false; }
+    std::copy(points, points + count, vertices.begin() + offset);
+    paths[ix] = {offset, count};
+    return true;
+  }
+
+  int size() const { return std::min<int>(npaths.load(), paths.size()); }
+};
@@ -2,7 +2,9 @@
 #include "raylib.h"
 #include "raymath.h"
 #include <stdlib.h>
+#include <stdio.h>
 #include <assert.h>
+#include <float.h>
 #include <optional>
 #include <functional>
 #include "optics.h"
@@ -16,18 +18,77 @@ static Vector2 v2(float x, float y) {
 enum class OpticMaterialKind {
   Reflective,
   Refractive,
-  Opaque,
+  Opaque, // absorbs the ray.
+  Detector, // absorbs the ray, which counts as detected.
 };
 
+// refractive index as a function of wavelength.
+//   Cauchy:    n = A + B / l^2 + C / l^4
+//   Sellmeier: n^2 = 1 + sum_i B_i l^2 / (l^2 - C_i)
+// with l the wavelength in micrometers.
+enum class DispersionModel {
+  Constant,
+  Cauchy,
+  Sellmeier,
+};
+
+// wavelength (nm) at which a material's nominal refractiveIndex is quoted, the sodium d line.
+static const float WAVELENGTH_D_LINE = 587.6;
+// the visible range (nm).
+static const float WAVELENGTH_MIN = 400;
+static const float WAVELENGTH_MAX = 700;
+
+struct Dispersion {
+  DispersionModel model = DispersionModel::Constant;
+  float b[3] = {1, 0, 0}; // Cauchy A, B, C; or Sellmeier B1, B2, B3.
+  float c[3] = {0, 0, 0}; // Sellmeier C1, C2, C3 (um^2).
+
+  float indexAt(float wavelength) const {
+    const float l = wavelength * 1e-3f;
+    const float l2 = l * l;
+    switch (model) {
+      case DispersionModel::Constant: return b[0];
+      case DispersionModel::Cauchy: return b[0] + b[1] / l2 + b[2] / (l2 * l2);
+      case DispersionModel::Sellmeier: {
+        float n2 = 1;
+        for(int i = 0; i < 3; ++i) { n2 += b[i] * l2 / (l2 - c[i]); }
+        return sqrtf(n2);
+      }
+    }
+    return b[0];
+  }
+};
+
+static inline Dispersion dispersionCauchy(float a, float b, float c = 0) {
+  Dispersion d;
+  d.model = DispersionModel::Cauchy;
+  d.b[0] = a; d.b[1] = b; d.b[2] = c;
+  return d;
+}
+
+static inline Dispersion dispersionSellmeier(const float b[3], const float c[3]) {
+  Dispersion d;
+  d.model = DispersionModel::Sellmeier;
+  for(int i = 0; i < 3; ++i) { d.b[i] = b[i]; d.c[i] = c[i]; }
+  return d;
+}
+
 struct OpticMaterial {
   OpticMaterialKind kind;
-  float refractiveIndex;
+  float refractiveIndex; // at WAVELENGTH_D_LINE, or for rays without a wavelength.
+  const Dispersion *dispersion = nullptr; // none: the same index at every wavelength.
 
-  OpticMaterial(OpticMaterialKind kind, float refractiveIndex) :
-      kind(kind), refractiveIndex(refractiveIndex){};
+  OpticMaterial(OpticMaterialKind kind, float refractiveIndex, const Dispersion *dispersion = nullptr) :
+      kind(kind), refractiveIndex(refractiveIndex), dispersion(dispersion) {};
+
+  // wavelength in nm, 0 for the nominal index.
+  float indexAt(float wavelength) const {
+    if (!dispersion || wavelength <= 0) { return refractiveIndex; }
+    return dispersion->indexAt(wavelength);
+  }
 
   bool operator == (const OpticMaterial &other) const {
-    return kind == other.kind && refractiveIndex == other.refractiveIndex;
+    return kind == other.kind && refractiveIndex == other.refractiveIndex && dispersion == other.dispersion;
   };
 
   bool operator != (const OpticMaterial &other) const {
@@ -41,6 +102,61 @@ struct SDFResult {
 
 };
 
+// where a ray first crosses a boundary: at origin + t * dir, with the outward
+// normal there. t is FLT_MAX when it never does.
+struct RayCrossing {
+  float t = FLT_MAX;
+  Vector2 normalOutward = v2(0, 0);
+};
+
+// forward-mode dual number: a value and its gradient with respect to the
+// point being evaluated. Writing an SDF once over a type T and running it
+// with T = Dual gives the exact gradient alongside the distance.
+struct Dual {
+  float v;
+  Vector2 d;
+
+  Dual(float v = 0) : v(v), d(v2(0, 0)) {};
+  Dual(float v, Vector2 d) : v(v), d(d) {};
+
+  // the coordinates of point as independent variables.
+  static Dual x(Vector2 point) { return Dual(point.x, v2(1, 0)); }
+  static Dual y(Vector2 point) { return Dual(point.y, v2(0, 1)); }
+};
+
+static inline Dual operator - (Dual a) { return Dual(-a.v, Vector2Negate(a.d)); }
+static inline Dual operator + (Dual a, Dual b) { return Dual(a.v + b.v, Vector2Add(a.d, b.d)); }
+static inline Dual operator - (Dual a, Dual b) { return Dual(a.v - b.v, Vector2Subtract(a.d, b.d)); }
+static inline Dual operator * (Dual a, Dual b) {
+  return Dual(a.v * b.v, Vector2Add(Vector2Scale(a.d, b.v), Vector2Scale(b.d, a.v)));
+}
+static inline Dual operator / (Dual a, Dual b) {
+  return Dual(a.v / b.v, Vector2Scale(Vector2Subtract(Vector2Scale(a.d, b.v), Vector2Scale(b.d, a.v)), 1.0f / (b.v * b.v)));
+}
+static inline Dual operator + (Dual a, float b) { return Dual(a.v + b, a.d); }
+static inline Dual operator + (float a, Dual b) { return Dual(a + b.v, b.d); }
+static inline Dual operator - (Dual a, float b) { return Dual(a.v - b, a.d); }
+static inline Dual operator - (float a, Dual b) { return Dual(a - b.v, Vector2Negate(b.d)); }
+static inline Dual operator * (Dual a, float b) { return Dual(a.v * b, Vector2Scale(a.d, b)); }
+static inline Dual operator * (float a, Dual b) { return Dual(a * b.v, Vector2Scale(b.d, a)); }
+
+// math that works on float and Dual alike, for SDFs written over T.
+static inline float dvalue(float a) { return a; }
+static inline float dvalue(Dual a) { return a.v; }
+static inline float dsqrt(float a) { return sqrtf(a); }
+static inline Dual dsqrt(Dual a) {
+  const float r = sqrtf(a.v);
+  // the gradient of sqrt blows up at 0; report no direction instead.
+  return Dual(r, r > 0 ? Vector2Scale(a.d, 0.5f / r) : v2(0, 0));
+}
+static inline float dabs(float a) { return fabs(a); }
+static inline Dual dabs(Dual a) { return a.v < 0 ? -a : a; }
+// ties go to b, like SDFIntersect / SDFUnion.
+static inline float dmax(float a, float b) { return a > b ? a : b; }
+static inline Dual dmax(Dual a, Dual b) { return a.v > b.v ? a : b; }
+static inline float dmin(float a, float b) { return a < b ? a : b; }
+static inline Dual dmin(Dual a, Dual b) { return a.v < b.v ? a : b; }
+
 // signed distance function that also produces normal vectors.
 struct SDF {
   virtual ~SDF() {};
@@ -49,9 +165,144 @@ struct SDF {
   // return a potentially unnormalized vector in the normal outward direction.
   // This is the direction of the gradient.
   virtual Vector2 dirOutwardAt(Vector2 point) = 0;
+
+  // distance and outward direction from a single evaluation.
+  virtual SDFResult eval(Vector2 point) {
+    SDFResult result;
+    result.dirOutward = dirOutwardAt(point);
+    result.dist = valueAt(point);
+    return result;
+  }
+
+  // a box [lo, hi] such that valueAt(p) is at least the distance from p to
+  // the box for points outside it. false if there is none (unbounded shapes,
+  // or distances that are not a lower bound like that).
+  virtual bool bounds(Vector2 &lo, Vector2 &hi) { return false; }
+
+  // the first crossing of the boundary by the ray origin + t * dir, t > tmin,
+  // dir normalized, in closed form. false if the shape has no closed form;
+  // the tracers sphere trace it instead.
+  virtual bool intersectRay(Vector2 origin, Vector2 dir, float tmin, RayCrossing &out) { return false; }
 };
 
-struct SDFCircle : public SDF {
+// an SDF given by `template<typename T> T distance(T x, T y)` in Derived.
+// valueAt runs it on floats, eval runs it on Duals for the exact gradient.
+template<typename Derived>
+struct SDFPrimitive : public SDF {
+  float valueAt(Vector2 point) {
+    return static_cast<Derived *>(this)->distance(point.x, point.y);
+  }
+
+  SDFResult eval(Vector2 point) {
+    const Dual d = static_cast<Derived *>(this)->distance(Dual::x(point), Dual::y(point));
+    SDFResult result;
+    result.dirOutward = d.d;
+    result.dist = d.v;
+    return result;
+  }
+
+  Vector2 dirOutwardAt(Vector2 point) { return eval(point).dirOutward; }
+};
+
+template<typename T>
+static inline T circleDistance(Vector2 center, float radius, T x, T y) {
+  const T dx = x - center.x;
+  const T dy = y - center.y;
+  return dsqrt(dx * dx + dy * dy) - radius;
+}
+
+// where the ray origin + t * dir (dir normalized) crosses a circle, in
+// increasing order; false for a miss or a graze that does not cross. In
+// double: the scenes use circles of radius 10^4, whose surface float cannot
+// resolve. The roots are rounded to float, as callers return them, so that
+// asking again from a crossing moves past it.
+static inline bool circleRayRoots(double cx, double cy, double radius, Vector2 origin, Vector2 dir,
+    float &t0, float &t1) {
+  const double ox = origin.x - cx, oy = origin.y - cy;
+  const double b = ox * dir.x + oy * dir.y;
+  const double c = ox * ox + oy * oy - radius * radius;
+  const double disc = b * b - c;
+  if (disc <= 0) { return false; }
+  // roots of t^2 + 2bt + c, without cancelling -b against the square root.
+  const double q = b > 0 ? -b - sqrt(disc) : -b + sqrt(disc);
+  t0 = std::min(q, c / q);
+  t1 = std::max(q, c / q);
+  return true;
+}
+
+// the first crossing of a circle after tmin.
+static inline bool circleIntersectRay(Vector2 center, float radius, Vector2 origin, Vector2 dir,
+    float tmin, RayCrossing &out) {
+  out = RayCrossing();
+  float t0, t1;
+  if (!circleRayRoots(center.x, center.y, radius, origin, dir, t0, t1)) { return true; }
+  const float t = t0 > tmin ? t0 : t1;
+  if (!(t > tmin)) { return true; }
+  out.t = t;
+  out.normalOutward = v2((origin.x - (double)center.x + dir.x * (double)t) / radius,
+      (origin.y - (double)center.y + dir.y * (double)t) / radius);
+  return true;
+}
+
+// the first crossing after tmin of the box [lo, hi], whose sides may be infinite.
+static inline bool boxIntersectRay(Vector2 lo, Vector2 hi, Vector2 origin, Vector2 dir,
+    float tmin, RayCrossing &out) {
+  out = RayCrossing();
+  float tnear = -INFINITY, tfar = INFINITY;
+  Vector2 nearNormal = v2(0, 0), farNormal = v2(0, 0);
+  for(int axis = 0; axis < 2; ++axis) {
+    const float o = axis ? origin.y : origin.x, d = axis ? dir.y : dir.x;
+    const float l = axis ? lo.y : lo.x, h = axis ? hi.y : hi.x;
+    if (d == 0) {
+      // parallel to this pair of sides: inside the slab throughout, or never.
+      if (o < l || o > h) { return true; }
+      continue;
+    }
+    // enter through the side facing the ray, leave through the other.
+    const float tin = ((d > 0 ? l : h) - o) / d, tout = ((d > 0 ? h : l) - o) / d;
+    const float side = d > 0 ? 1 : -1;
+    if (tin > tnear) { tnear = tin; nearNormal = axis ? v2(0, -side) : v2(-side, 0); }
+    if (tout < tfar) { tfar = tout; farNormal = axis ? v2(0, side) : v2(side, 0); }
+  }
+  if (tnear > tfar) { return true; }
+  if (tnear > tmin) {
+    out.t = tnear;
+    out.normalOutward = nearNormal;
+  } else if (tfar > tmin && tfar < FLT_MAX) {
+    out.t = tfar;
+    out.normalOutward = farNormal;
+  }
+  return true;
+}
+
+// a shape as seen by combinedIntersectRay; sdfexpr.h adds expression nodes.
+static inline float rayShapeValue(SDF *s, Vector2 point) { return s->valueAt(point); }
+static inline bool rayShapeCrossing(SDF *s, Vector2 origin, Vector2 dir, float tmin, RayCrossing &out) {
+  return s->intersectRay(origin, dir, tmin, out);
+}
+
+// the first crossing after tmin of the boundary of a and b intersected (or
+// united), from the crossings of a and b: a crossing of one is on it where
+// the other is inside (outside, for a union).
+template<typename A, typename B>
+static bool combinedIntersectRay(const A &a, const B &b, bool intersection,
+    Vector2 origin, Vector2 dir, float tmin, RayCrossing &out) {
+  RayCrossing ca, cb;
+  if (!rayShapeCrossing(a, origin, dir, tmin, ca) || !rayShapeCrossing(b, origin, dir, tmin, cb)) {
+    return false;
+  }
+  for(;;) {
+    const bool first = ca.t <= cb.t;
+    const RayCrossing c = first ? ca : cb;
+    if (c.t == FLT_MAX) { out = c; return true; }
+    const Vector2 point = Vector2Add(origin, Vector2Scale(dir, c.t));
+    const bool otherInside = (first ? rayShapeValue(b, point) : rayShapeValue(a, point)) <= 0;
+    if (otherInside == intersection) { out = c; return true; }
+    if (first) { rayShapeCrossing(a, origin, dir, c.t, ca); } else { rayShapeCrossing(b, origin, dir, c.t, cb); }
+  }
+}
+
+struct SDFCircle : public SDFPrimitive<SDFCircle> {
 
   Vector2 center;
   float radius;
@@ -59,12 +310,17 @@ struct SDFCircle : public SDF {
   SDFCircle() : center(v2(0, 0)), radius(0) {}
   SDFCircle(Vector2 center, float radius) : center(center), radius(radius) {};
 
-  float valueAt(Vector2 point) {
-    return Vector2Length(Vector2Subtract(center, point)) - radius;
-  };
+  template<typename T>
+  T distance(T x, T y) { return circleDistance(center, radius, x, y); }
+
+  bool bounds(Vector2 &lo, Vector2 &hi) {
+    lo = v2(center.x - radius, center.y - radius);
+    hi = v2(center.x + radius, center.y + radius);
+    return true;
+  }
 
-  Vector2 dirOutwardAt(Vector2 point) {
-    return Vector2Subtract(point, center);
+  bool intersectRay(Vector2 origin, Vector2 dir, float tmin, RayCrossing &out) {
+    return circleIntersectRay(center, radius, origin, dir, tmin, out);
   }
 };
 
@@ -75,12 +331,27 @@ struct SDFIntersect : public SDF {
   float valueAt(Vector2 point) {
     return std::max<float>(s1->valueAt(point), s2->valueAt(point));
   }
-  Vector2 dirOutwardAt (Vector2 point) {
-    if (s1->valueAt(point) > s2->valueAt(point)) {
-      return s1->dirOutwardAt(point);
-    } else {
-      return s2->dirOutwardAt(point);
-    }
+  SDFResult eval(Vector2 point) {
+    const SDFResult r1 = s1->eval(point);
+    const SDFResult r2 = s2->eval(point);
+    return r1.dist > r2.dist ? r1 : r2;
+  }
+  Vector2 dirOutwardAt (Vector2 point) { return eval(point).dirOutward; }
+  // max(d1, d2) >= d1, so either child's box works. Not their overlap,
+  // which max(d1, d2) need not bound. Take the smaller.
+  bool bounds(Vector2 &lo, Vector2 &hi) {
+    Vector2 lo1, hi1, lo2, hi2;
+    const bool b1 = s1->bounds(lo1, hi1);
+    const bool b2 = s2->bounds(lo2, hi2);
+    if (!b1 && !b2) { return false; }
+    const bool first = b1 && (!b2 ||
+        (hi1.x - lo1.x) * (hi1.y - lo1.y) <= (hi2.x - lo2.x) * (hi2.y - lo2.y));
+    lo = first ? lo1 : lo2;
+    hi = first ? hi1 : hi2;
+    return true;
+  }
+  bool intersectRay(Vector2 origin, Vector2 dir, float tmin, RayCrossing &out) {
+    return combinedIntersectRay(s1, s2, true, origin, dir, tmin, out);
   }
 };
 
@@ -91,56 +362,333 @@ struct SDFUnion : public SDF {
   float valueAt(Vector2 point) {
     return std::min<float>(s1->valueAt(point), s2->valueAt(point));
   }
-  Vector2 dirOutwardAt (Vector2 point) {
-    if (s1->valueAt(point) < s2->valueAt(point)) {
-      return s1->dirOutwardAt(point);
+  SDFResult eval(Vector2 point) {
+    const SDFResult r1 = s1->eval(point);
+    const SDFResult r2 = s2->eval(point);
+    return r1.dist < r2.dist ? r1 : r2;
+  }
+  Vector2 dirOutwardAt (Vector2 point) { return eval(point).dirOutward; }
+  bool bounds(Vector2 &lo, Vector2 &hi) {
+    Vector2 lo1, hi1, lo2, hi2;
+    if (!s1->bounds(lo1, hi1) || !s2->bounds(lo2, hi2)) { return false; }
+    lo = v2(std::min<float>(lo1.x, lo2.x), std::min<float>(lo1.y, lo2.y));
+    hi = v2(std::max<float>(hi1.x, hi2.x), std::max<float>(hi1.y, hi2.y));
+    return true;
+  }
+  bool intersectRay(Vector2 origin, Vector2 dir, float tmin, RayCrossing &out) {
+    return combinedIntersectRay(s1, s2, false, origin, dir, tmin, out);
+  }
+};
+
+// how far a spherical surface of signed radius r (0: flat) has moved along
+// the axis from its vertex at height y off the axis, |y| <= |r|. The sagitta,
+// in the form that stays precise for large radii.
+static inline float lensSag(float r, float y) {
+  if (r == 0) { return 0; }
+  return y * y / (r + copysignf(sqrtf(std::max<float>(r * r - y * y, 0)), r));
+}
+
+// a lens on the horizontal axis through center: two spherical surfaces
+// thickness apart on the axis, cut off by a flat rim at halfHeight from it,
+// or where the surfaces meet if that comes first. r1 and r2 are the radii of
+// the left and right surface, positive when the center of curvature lies to
+// the right (+x), 0 for a flat surface: r1 > 0 > r2 is biconvex, r1 < 0 < r2
+// biconcave, equal signs a meniscus.
+//
+// The distance is exact: to the nearest of the two arcs and the rim. It is
+// computed relative to the vertices, so radii of 10^4 keep their precision
+// near the surface, where max() of two circle distances does not. Call set()
+// after changing the shape.
+struct SDFLens : public SDFPrimitive<SDFLens> {
+  Vector2 center = v2(0, 0);
+  float thickness = 0;
+  float r1 = 0, r2 = 0;
+  float halfHeight = 0;
+  // derived by set(): the rim's height off the axis and where it meets the
+  // left and right surface, relative to center.
+  float rim = 0, rimLeft = 0, rimRight = 0;
+
+  SDFLens() {}
+  SDFLens(Vector2 center, float thickness, float r1, float r2, float halfHeight) {
+    set(center, thickness, r1, r2, halfHeight);
+  }
+
+  void set(Vector2 center, float thickness, float r1, float r2, float halfHeight) {
+    this->center = center;
+    this->thickness = thickness;
+    this->r1 = r1;
+    this->r2 = r2;
+    this->halfHeight = halfHeight;
+    // a surface ends where it turns parallel to the axis.
+    rim = halfHeight;
+    if (r1 != 0) { rim = std::min<float>(rim, fabs(r1)); }
+    if (r2 != 0) { rim = std::min<float>(rim, fabs(r2)); }
+    // the surfaces cross before the rim: lower it to where they meet.
+    if (edgeThickness(rim) < 0) {
+      float lo = 0, hi = rim;
+      for(int i = 0; i < 64 && lo < hi; ++i) {
+        const float mid = 0.5f * (lo + hi);
+        if (edgeThickness(mid) < 0) { hi = mid; } else { lo = mid; }
+      }
+      rim = lo;
+    }
+    rimLeft = -0.5f * thickness + lensSag(r1, rim);
+    rimRight = 0.5f * thickness + lensSag(r2, rim);
+  }
+
+  // distance between the surfaces at height y off the axis.
+  float edgeThickness(float y) const { return thickness + lensSag(r2, y) - lensSag(r1, y); }
+
+  template<typename T>
+  T distance(T x, T y) {
+    const T px = x - center.x;
+    // the lens is symmetric about its axis.
+    const T py = dabs(y - center.y);
+    const float fx = dvalue(px), fy = dvalue(py);
+    const bool inside = fy <= rim &&
+        fx >= -0.5f * thickness + lensSag(r1, fy) && fx <= 0.5f * thickness + lensSag(r2, fy);
+    const T dleft = surfaceDistance(-0.5f * thickness, r1, rimLeft, px, py);
+    const T dright = surfaceDistance(0.5f * thickness, r2, rimRight, px, py);
+    // the rim, from rimLeft to rimRight at height rim.
+    T drim;
+    if (fx < rimLeft || fx > rimRight) {
+      const T ex = px - (fx < rimLeft ? rimLeft : rimRight), ey = py - rim;
+      drim = dsqrt(ex * ex + ey * ey);
+    } else {
+      drim = dabs(py - rim);
+    }
+    const T d = dmin(dmin(dleft, dright), drim);
+    return inside ? -d : d;
+  }
+
+  // distance to the part of a surface with its vertex at v on the axis
+  // and radius r that lies between the axis and the rim, which it meets at
+  // (end, rim).
+  template<typename T>
+  T surfaceDistance(float v, float r, float end, T px, T py) const {
+    const T qx = px - v;
+    if (r == 0) {
+      if (dvalue(py) <= rim) { return dabs(qx); }
     } else {
-      return s2->dirOutwardAt(point);
+      const float R = fabs(r), s = r > 0 ? 1 : -1;
+      // from the center of curvature towards the vertex.
+      const float along = R - s * dvalue(qx);
+      // within the wedge the arc spans as seen from its center, the nearest
+      // point of the circle is on the arc.
+      if (along > 0 && dvalue(py) * sqrtf(std::max<float>(R * R - rim * rim, 0)) <= rim * along) {
+        // |q - c| - R as (|q - c|^2 - R^2) / (|q - c| + R), c = (r, 0) from the vertex.
+        const T len = dsqrt((qx - r) * (qx - r) + py * py);
+        return dabs((qx * qx - 2 * r * qx + py * py) / (len + R));
+      }
+    }
+    // otherwise the end of the arc, at the rim, is nearest.
+    const T ex = px - end, ey = py - rim;
+    return dsqrt(ex * ex + ey * ey);
+  }
+
+  bool bounds(Vector2 &lo, Vector2 &hi) {
+    lo = v2(center.x + std::min<float>(-0.5f * thickness, rimLeft), center.y - rim);
+    hi = v2(center.x + std::max<float>(0.5f * thickness, rimRight), center.y + rim);
+    return true;
+  }
+
+  bool intersectRay(Vector2 origin, Vector2 dir, float tmin, RayCrossing &out) {
+    out = RayCrossing();
+    // a crossing of the surface through (v, 0) at t, if it is on the lens and the nearest so far.
+    auto surface = [&](float v, float r, float sign) {
+      const double cx = (double)center.x + v + r;
+      auto consider = [&](float t) {
+        if (!(t > tmin) || t >= out.t) { return; }
+        const double hx = origin.x + dir.x * (double)t, hy = origin.y + dir.y * (double)t;
+        if (fabs(hy - center.y) > rim) { return; }
+        // on the arc between the rims, not the rest of the circle.
+        if (r != 0 && (r > 0 ? hx > cx : hx < cx)) { return; }
+        out.t = t;
+        out.normalOutward = r == 0 ? v2(sign, 0) : v2(-sign * (hx - cx) / r, -sign * (hy - center.y) / r);
+      };
+      if (r == 0) {
+        if (dir.x != 0) { consider((center.x + v - (double)origin.x) / dir.x); }
+        return;
+      }
+      float t0, t1;
+      if (circleRayRoots(cx, center.y, r, origin, dir, t0, t1)) { consider(t0); consider(t1); }
+    };
+    surface(-0.5f * thickness, r1, -1);
+    surface(0.5f * thickness, r2, 1);
+    // the rims above and below the axis.
+    if (dir.y != 0 && rimLeft < rimRight) {
+      for(float side : {-1.0f, 1.0f}) {
+        const float t = (center.y + side * rim - (double)origin.y) / dir.y;
+        if (!(t > tmin) || t >= out.t) { continue; }
+        const float hx = origin.x + dir.x * t - center.x;
+        if (hx < rimLeft || hx > rimRight) { continue; }
+        out.t = t;
+        out.normalOutward = v2(0, side);
+      }
     }
+    return true;
   }
 };
 
-struct SDFAABB : public SDF {
+// exact signed distance to a box, from q = |p - center| - halfSize per
+// axis. Only min and max, no branches, so it vectorizes (packetBoxDist is
+// the same for packets), and over Dual it carries the gradient: unit length
+// everywhere, pointing away from the nearest face or corner.
+template<typename T>
+static inline T boxDistance(T qx, T qy) {
+  const T ox = dmax(qx, T(0)), oy = dmax(qy, T(0));
+  return dsqrt(ox * ox + oy * oy) + dmin(dmax(qx, qy), T(0));
+}
+
+// an axis aligned box, with its corners rounded off by radius when radius > 0.
+struct SDFAABB : public SDFPrimitive<SDFAABB> {
   Vector2 topLeft = v2(0, 0);
   Vector2 bottomRight = v2(0, 0);
+  float radius = 0;
   SDFAABB() : topLeft(v2(0, 0)), bottomRight(v2(0, 0)) {}
-  SDFAABB(Vector2 topLeft, Vector2 bottomRight) : topLeft(topLeft), bottomRight(bottomRight) {}
+  SDFAABB(Vector2 topLeft, Vector2 bottomRight, float radius = 0) :
+    topLeft(topLeft), bottomRight(bottomRight), radius(radius) {}
 
+  Vector2 center() const { return Vector2Scale(Vector2Add(topLeft, bottomRight), 0.5); }
+  Vector2 halfSize() const { return Vector2Scale(Vector2Subtract(bottomRight, topLeft), 0.5); }
 
-  Vector2 dirOutwardAt (Vector2 point) { return run(point).second; }
-
-  float valueAt(Vector2 point) { return run(point).first; }
-
-  std::pair<float, Vector2> run(Vector2 point) {
+  template<typename T>
+  T distance(T x, T y) {
     assert(topLeft.x <= bottomRight.x);
     assert(topLeft.y <= bottomRight.y);
-    // tl + (br - tl) * 0.5 = tl * 0.5 + br * 0.5 = (tl + br) * 0.5;
-    Vector2 mid = Vector2Scale(Vector2Add(topLeft, bottomRight), 0.5);
-    int width = bottomRight.x - topLeft.x;
-    int height = bottomRight.y - topLeft.y;
-
-    Vector2 delta = Vector2Subtract(point, mid);
-    if (fabs(delta.x) < fabs(delta.y)) {
-      return {fabs(delta.x) - width, v2(delta.x, 0)};
-    } else {
-      return {fabs(delta.y) - height, v2(0, delta.y)}; 
-    }
+    const Vector2 mid = center(), half = halfSize();
+    // a rounded box is the box shrunk by radius, grown back by radius.
+    const T qx = dabs(x - mid.x) - (half.x - radius);
+    const T qy = dabs(y - mid.y) - (half.y - radius);
+    return boxDistance(qx, qy) - radius;
+  }
+
+  bool bounds(Vector2 &lo, Vector2 &hi) {
+    lo = topLeft;
+    hi = bottomRight;
+    return true;
+  }
+
+  // rounded corners are arcs, which the slab test does not know: march those.
+  bool intersectRay(Vector2 origin, Vector2 dir, float tmin, RayCrossing &out) {
+    return radius == 0 && boxIntersectRay(topLeft, bottomRight, origin, dir, tmin, out);
+  }
+};
+
+// the screen of scenes D and F: an axis aligned box centered on (x, y).
+struct ScreenData : public SDFPrimitive<ScreenData> {
+  int x;
+  int y;
+  int halfWidth;
+  int halfHeight;
+
+  template<typename T>
+  T distance(T px, T py) {
+    return boxDistance(dabs(px - x) - halfWidth, dabs(py - y) - halfHeight);
+  }
+
+  bool bounds(Vector2 &lo, Vector2 &hi) {
+    lo = v2(x - halfWidth, y - halfHeight);
+    hi = v2(x + halfWidth, y + halfHeight);
+    return true;
   }
+
+  bool intersectRay(Vector2 origin, Vector2 dir, float tmin, RayCrossing &out) {
+    return boxIntersectRay(v2(x - halfWidth, y - halfHeight), v2(x + halfWidth, y + halfHeight),
+        origin, dir, tmin, out);
+  }
+};
+
+// the aperture of scenes D and F: a wall of width 2 halfWidth at x, with an
+// opening of height 2 halfOpeningHeight centered on y.
+struct ApertureData : public SDFPrimitive<ApertureData> {
+  int x = 0;
+  int y = 0;
+  float halfOpeningHeight = 0;
+  float halfWidth = 0;
+
+  template<typename T>
+  T distance(T px, T py) {
+    // the slab |px - x| <= halfWidth less the opening: a box whose extent
+    // in y is the outside of the opening.
+    return boxDistance(dabs(px - x) - halfWidth, halfOpeningHeight - dabs(py - y));
+  }
+
+  // the stops above and below the opening, boxes running off to infinity.
+  bool intersectRay(Vector2 origin, Vector2 dir, float tmin, RayCrossing &out) {
+    RayCrossing above, below;
+    boxIntersectRay(v2(x - halfWidth, -INFINITY), v2(x + halfWidth, y - halfOpeningHeight), origin, dir, tmin, above);
+    boxIntersectRay(v2(x - halfWidth, y + halfOpeningHeight), v2(x + halfWidth, INFINITY), origin, dir, tmin, below);
+    out = above.t <= below.t ? above : below;
+    return true;
+  }
+};
+
+// counters filled in by the tracers when the scene carries a stats pointer.
+// SDF evaluations count top-level queries made by the tracer, not the nodes
+// visited inside a composite SDF.
+struct TraceStats {
+  long long nrays = 0;
+  long long nsteps = 0;
+  long long nsdfEvals = 0;
+  long long ndetected = 0; // rays that ended on a detector (the screen).
+};
+
+// fixed parameters used to trace a scene without a window, see bench.cpp.
+struct BenchParams {
+  int screenWidth;
+  int screenHeight;
+  Vector2 source;
+  float lensThickness;
+  float apertureHalfOpeningHeight;
+};
+
+// a shape in a scene and the material inside it.
+struct SceneElement {
+  SDF *sdf = nullptr;
+  OpticMaterial material = OpticMaterial(OpticMaterialKind::Refractive, 1.0);
+};
+
+// everything one scene query learns about a point.
+struct SceneHit {
+  float dist = 0; // signed distance to the nearest element.
+  int element = -1; // the nearest element, -1 for a glassSDF scene.
+  OpticMaterial material = OpticMaterial(OpticMaterialKind::Refractive, 1.0); // the medium at the point.
 };
 
+struct SDFBVH;
+
 struct Scene {
-  SDF *glassSDF;
+  // a single piece of glass in air, for scenes without elements.
+  SDF *glassSDF = nullptr;
+  // when set, the scene is made of these elements instead, in air.
+  const SceneElement *elements = nullptr;
+  int nelements = 0;
+  // the elements' SDFs in a tree (sdfbvh.h), ids their indices in elements.
+  SDFBVH *bvh = nullptr;
+  // wavelength of the rays in nm for dispersive materials, 0 traces at the nominal index.
+  float wavelength = 0;
+  // draw rays while tracing. Turned off when benchmarking headless.
+  bool draw = true;
+  TraceStats *stats = nullptr;
 };
 
 static const float REFRACTIVE_INDEX_GLASS = 2;
 
-static OpticMaterial materialQuery(Scene s, Vector2 point) {
-  float dist = s.glassSDF->valueAt(point);
+static OpticMaterial materialAir() {
+  return OpticMaterial(OpticMaterialKind::Refractive, 1.0);
+}
+
+static OpticMaterial materialGlass() {
+  return OpticMaterial(OpticMaterialKind::Refractive, REFRACTIVE_INDEX_GLASS);
+}
+
+static OpticMaterial materialAtGlassDist(float dist) {
   if (dist > 0) {
-    return OpticMaterial(OpticMaterialKind::Refractive, 1.0);
+    return materialAir();
   } else {
     // glass
-    return OpticMaterial(OpticMaterialKind::Refractive, REFRACTIVE_INDEX_GLASS);
+    return materialGlass();
   }
 }
 
@@ -154,8 +702,3 @@ static bool inbounds(Vector2 bottomLeft, Vector2 cur, Vector2 topRight) {
   return true;
 }
 
-
-static float randFloat01() {
-  return ((float)rand()/(float)(RAND_MAX));
-}
-
@@ -0,0 +1,496 @@
+#pragma once
+// SIMD ray-packet tracer for the lens scenes.
+//
+// Rays are advanced PACKET_WIDTH at a time (16 with AVX-512, 8 with AVX2,
+// 4 with SSE2 or plain arrays otherwise) in structure-of-arrays layout. The
+// lens is a biconvex SDFLens whose surfaces meet before its rim, which is
+// the intersection of two circles, with an optional aperture and screen:
+// scenes D and F. Lanes retire individually; the packet keeps stepping while
+// any lane is alive.
+//
+// Physics matches raymarch(): the same material test and Snell/TIR update,
+// done with masked lanes instead of branches. The lanes sphere trace where
+// the scalar scenes jump between closed-form crossings, but a step that
+// crosses the lens or enters the screen is refined onto the surface as
+// raymarch() does, and the circles are evaluated relative to the lens
+// vertices, as in SDFLens. So hits and bends agree with the scalar tracer to
+// TOLERANCE; only the number of steps differs. Each lane may carry its own
+// glass index, which is how spectral.h traces wavelengths side by side.
+#include "optics.h"
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX512F__)
+#define PACKET_WIDTH 16
+struct floatv { __m512 v; };
+struct maskv { __mmask16 m; };
+
+static inline floatv vbroadcast(float f) { return {_mm512_set1_ps(f)}; }
+static inline floatv vload(const float *p) { return {_mm512_loadu_ps(p)}; }
+static inline void vstore(float *p, floatv a) { _mm512_storeu_ps(p, a.v); }
+static inline floatv operator + (floatv a, floatv b) { return {_mm512_add_ps(a.v, b.v)}; }
+static inline floatv operator - (floatv a, floatv b) { return {_mm512_sub_ps(a.v, b.v)}; }
+static inline floatv operator * (floatv a, floatv b) { return {_mm512_mul_ps(a.v, b.v)}; }
+static inline floatv operator / (floatv a, floatv b) { return {_mm512_div_ps(a.v, b.v)}; }
+// full-mask forms: the plain ones merge into _mm512_undefined_ps(), which gcc -Wall flags.
+static inline floatv vsqrt(floatv a) { return {_mm512_mask_sqrt_ps(a.v, 0xffff, a.v)}; }
+static inline floatv vmin(floatv a, floatv b) { return {_mm512_mask_min_ps(a.v, 0xffff, a.v, b.v)}; }
+static inline floatv vmax(floatv a, floatv b) { return {_mm512_mask_max_ps(a.v, 0xffff, a.v, b.v)}; }
+static inline floatv vabs(floatv a) { return {_mm512_abs_ps(a.v)}; }
+static inline maskv vlt(floatv a, floatv b) { return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ)}; }
+static inline maskv vle(floatv a, floatv b) { return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ)}; }
+static inline maskv vge(floatv a, floatv b) { return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ)}; }
+// a where m is set, b elsewhere.
+static inline floatv vselect(maskv m, floatv a, floatv b) { return {_mm512_mask_blend_ps(m.m, b.v, a.v)}; }
+static inline maskv operator & (maskv a, maskv b) { return {(__mmask16)(a.m & b.m)}; }
+static inline maskv operator | (maskv a, maskv b) { return {(__mmask16)(a.m | b.m)}; }
+static inline maskv operator ^ (maskv a, maskv b) { return {(__mmask16)(a.m ^ b.m)}; }
+// a and not b.
+static inline maskv vandnot(maskv a, maskv b) { return {(__mmask16)(a.m & ~b.m)}; }
+static inline maskv vmaskfirst(int n) { return {(__mmask16)((1u << n) - 1)}; }
+static inline int vbits(maskv m) { return m.m; }
+
+#elif defined(__AVX2__)
+#define PACKET_WIDTH 8
+struct floatv { __m256 v; };
+struct maskv { __m256 m; };
+
+static inline floatv vbroadcast(float f) { return {_mm256_set1_ps(f)}; }
+static inline floatv vload(const float *p) { return {_mm256_loadu_ps(p)}; }
+static inline void vstore(float *p, floatv a) { _mm256_storeu_ps(p, a.v); }
+static inline floatv operator + (floatv a, floatv b) { return {_mm256_add_ps(a.v, b.v)}; }
+static inline floatv operator - (floatv a, floatv b) { return {_mm256_sub_ps(a.v, b.v)}; }
+static inline floatv operator * (floatv a, floatv b) { return {_mm256_mul_ps(a.v, b.v)}; }
+static inline floatv operator / (floatv a, floatv b) { return {_mm256_div_ps(a.v, b.v)}; }
+static inline floatv vsqrt(floatv a) { return {_mm256_sqrt_ps(a.v)}; }
+static inline floatv vmin(floatv a, floatv b) { return {_mm256_min_ps(a.v, b.v)}; }
+static inline floatv vmax(floatv a, floatv b) { return {_mm256_max_ps(a.v, b.v)}; }
+static inline floatv vabs(floatv a) {
+  return {_mm256_and_ps(a.v, _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff)))};
+}
+static inline maskv vlt(floatv a, floatv b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)}; }
+static inline maskv vle(floatv a, floatv b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)}; }
+static inline maskv vge(floatv a, floatv b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)}; }
+// a where m is set, b elsewhere.
+static inline floatv vselect(maskv m, floatv a, floatv b) { return {_mm256_blendv_ps(b.v, a.v, m.m)}; }
+static inline maskv operator & (maskv a, maskv b) { return {_mm256_and_ps(a.m, b.m)}; }
+static inline maskv operator | (maskv a, maskv b) { return {_mm256_or_ps(a.m, b.m)}; }
+static inline maskv operator ^ (maskv a, maskv b) { return {_mm256_xor_ps(a.m, b.m)}; }
+// a and not b.
+static inline maskv vandnot(maskv a, maskv b) { return {_mm256_andnot_ps(b.m, a.m)}; }
+static inline maskv vmaskfirst(int n) {
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  return {_mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(n), lanes))};
+}
+static inline int vbits(maskv m) { return _mm256_movemask_ps(m.m); }
+
+#elif defined(__SSE2__) || defined(_M_X64)
+// baseline x86-64.
+#define PACKET_WIDTH 4
+struct floatv { __m128 v; };
+struct maskv { __m128 m; };
+
+static inline floatv vbroadcast(float f) { return {_mm_set1_ps(f)}; }
+static inline floatv vload(const float *p) { return {_mm_loadu_ps(p)}; }
+static inline void vstore(float *p, floatv a) { _mm_storeu_ps(p, a.v); }
+static inline floatv operator + (floatv a, floatv b) { return {_mm_add_ps(a.v, b.v)}; }
+static inline floatv operator - (floatv a, floatv b) { return {_mm_sub_ps(a.v, b.v)}; }
+static inline floatv operator * (floatv a, floatv b) { return {_mm_mul_ps(a.v, b.v)}; }
+static inline floatv operator / (floatv a, floatv b) { return {_mm_div_ps(a.v, b.v)}; }
+static inline floatv vsqrt(floatv a) { return {_mm_sqrt_ps(a.v)}; }
+static inline floatv vmin(floatv a, floatv b) { return {_mm_min_ps(a.v, b.v)}; }
+static inline floatv vmax(floatv a, floatv b) { return {_mm_max_ps(a.v, b.v)}; }
+static inline floatv vabs(floatv a) {
+  return {_mm_and_ps(a.v, _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff)))};
+}
+static inline maskv vlt(floatv a, floatv b) { return {_mm_cmplt_ps(a.v, b.v)}; }
+static inline maskv vle(floatv a, floatv b) { return {_mm_cmple_ps(a.v, b.v)}; }
+static inline maskv vge(floatv a, floatv b) { return {_mm_cmpge_ps(a.v, b.v)}; }
+// a where m is set, b elsewhere.
+static inline floatv vselect(maskv m, floatv a, floatv b) {
+  return {_mm_or_ps(_mm_and_ps(m.m, a.v), _mm_andnot_ps(m.m, b.v))};
+}
+static inline maskv operator & (maskv a, maskv b) { return {_mm_and_ps(a.m, b.m)}; }
+static inline maskv operator | (maskv a, maskv b) { return {_mm_or_ps(a.m, b.m)}; }
+static inline maskv operator ^ (maskv a, maskv b) { return {_mm_xor_ps(a.m, b.m)}; }
+// a and not b.
+static inline maskv vandnot(maskv a, maskv b) { return {_mm_andnot_ps(b.m, a.m)}; }
+static inline maskv vmaskfirst(int n) {
+  const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+  return {_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_set1_epi32(n), lanes))};
+}
+static inline int vbits(maskv m) { return _mm_movemask_ps(m.m); }
+
+#else
+// portable fallback: plain arrays the compiler is free to vectorize.
+#define PACKET_WIDTH 4
+struct floatv { float v[PACKET_WIDTH]; };
+struct maskv { bool m[PACKET_WIDTH]; };
+
+#define PACKET_LANEWISE(expr) for(int l = 0; l < PACKET_WIDTH; ++l) { expr; }
+static inline floatv vbroadcast(float f) { floatv r; PACKET_LANEWISE(r.v[l] = f); return r; }
+static inline floatv vload(const float *p) { floatv r; PACKET_LANEWISE(r.v[l] = p[l]); return r; }
+static inline void vstore(float *p, floatv a) { PACKET_LANEWISE(p[l] = a.v[l]); }
+static inline floatv operator + (floatv a, floatv b) { floatv r; PACKET_LANEWISE(r.v[l] = a.v[l] + b.v[l]); return r; }
+static inline floatv operator - (floatv a, floatv b) { floatv r; PACKET_LANEWISE(r.v[l] = a.v[l] - b.v[l]); return r; }
+static inline floatv operator * (floatv a, floatv b) { floatv r; PACKET_LANEWISE(r.v[l] = a.v[l] * b.v[l]); return r; }
+static inline floatv operator / (floatv a, floatv b) { floatv r; PACKET_LANEWISE(r.v[l] = a.v[l] / b.v[l]); return r; }
+static inline floatv vsqrt(floatv a) { floatv r; PACKET_LANEWISE(r.v[l] = sqrtf(a.v[l])); return r; }
+static inline floatv vmin(floatv a, floatv b) { floatv r; PACKET_LANEWISE(r.v[l] = a.v[l] < b.v[l] ? a.v[l] : b.v[l]); return r; }
+static inline floatv vmax(floatv a, floatv b) { floatv r; PACKET_LANEWISE(r.v[l] = a.v[l] > b.v[l] ? a.v[l] : b.v[l]); return r; }
+static inline floatv vabs(floatv a) { floatv r; PACKET_LANEWISE(r.v[l] = fabsf(a.v[l])); return r; }
+static inline maskv vlt(floatv a, floatv b) { maskv r; PACKET_LANEWISE(r.m[l] = a.v[l] < b.v[l]); return r; }
+static inline maskv vle(floatv a, floatv b) { maskv r; PACKET_LANEWISE(r.m[l] = a.v[l] <= b.v[l]); return r; }
+static inline maskv vge(floatv a, floatv b) { maskv r; PACKET_LANEWISE(r.m[l] = a.v[l] >= b.v[l]); return r; }
+// a where m is set, b elsewhere.
+static inline floatv vselect(maskv m, floatv a, floatv b) { floatv r; PACKET_LANEWISE(r.v[l] = m.m[l] ? a.v[l] : b.v[l]); return r; }
+static inline maskv operator & (maskv a, maskv b) { maskv r; PACKET_LANEWISE(r.m[l] = a.m[l] && b.m[l]); return r; }
+static inline maskv operator | (maskv a, maskv b) { maskv r; PACKET_LANEWISE(r.m[l] = a.m[l] || b.m[l]); return r; }
+static inline maskv operator ^ (maskv a, maskv b) { maskv r; PACKET_LANEWISE(r.m[l] = a.m[l] != b.m[l]); return r; }
+// a and not b.
+static inline maskv vandnot(maskv a, maskv b) { maskv r; PACKET_LANEWISE(r.m[l] = a.m[l] && !b.m[l]); return r; }
+static inline maskv vmaskfirst(int n) { maskv r; PACKET_LANEWISE(r.m[l] = l < n); return r; }
+static inline int vbits(maskv m) { int bits = 0; PACKET_LANEWISE(bits |= m.m[l] << l); return bits; }
+#undef PACKET_LANEWISE
+#endif
+
+static inline bool vany(maskv m) { return vbits(m) != 0; }
+static inline int vcount(maskv m) {
+  int count = 0;
+  for(int bits = vbits(m); bits; bits &= bits - 1) { count++; }
+  return count;
+}
+
+// everything the packet tracer needs to know about a scene, as plain numbers.
+struct PacketScene {
+  // lens = intersection of the circles through the vertices (lensVertex1X,
+  // lensY) and (lensVertex2X, lensY), with signed radii as in SDFLens.
+  float lensVertex1X = 0, lensVertex2X = 0, lensY = 0;
+  float lensR1 = 0, lensR2 = 0;
+  float refractiveIndex = REFRACTIVE_INDEX_GLASS;
+
+  // aperture: the slab |x - apertureX| <= apertureHalfWidth, open for |y - apertureY| < apertureHalfOpeningHeight.
+  bool hasAperture = false;
+  float apertureX = 0, apertureY = 0, apertureHalfWidth = 0, apertureHalfOpeningHeight = 0;
+
+  // screen: axis aligned box.
+  bool hasScreen = false;
+  float screenX = 0, screenY = 0, screenHalfWidth = 0, screenHalfHeight = 0;
+
+  Vector2 bottomLeft, topRight;
+
+  // the circles of a biconvex lens whose surfaces meet before its rim: the
+  // lens is exactly their intersection.
+  void setLens(const SDFLens &lens) {
+    assert(lens.r1 > 0 && lens.r2 < 0 && lens.rim < lens.halfHeight);
+    lensVertex1X = lens.center.x - 0.5f * lens.thickness;
+    lensVertex2X = lens.center.x + 0.5f * lens.thickness;
+    lensY = lens.center.y;
+    lensR1 = lens.r1;
+    lensR2 = lens.r2;
+  }
+};
+
+// the same knobs as a raymarch() step policy.
+struct PacketStep {
+  int nsteps;
+  float stepFactor;
+  float minTraceDist;
+  float maxTraceDist;
+};
+
+struct PacketRayResult {
+  Vector2 point;
+  Vector2 dir;
+  int nsteps;
+  bool refracted;
+  bool totalInternalReflected;
+  bool intersectedAperture;
+  bool intersectedScreen;
+};
+
+// exact box distance given q = |p - center| - halfExtents per axis.
+static inline floatv packetBoxDist(floatv qx, floatv qy) {
+  const floatv zero = vbroadcast(0);
+  const floatv ox = vmax(qx, zero);
+  const floatv oy = vmax(qy, zero);
+  return vsqrt(ox * ox + oy * oy) + vmin(vmax(qx, qy), zero);
+}
+
+// the scene and step broadcast once, and the kernels that march and bend
+// rays with them. tracePacketLanes and the wavefront tracer (wavefront.h)
+// both trace with these; they differ only in how they schedule the lanes.
+struct PacketKernel {
+  floatv zero, one, tolerance;
+  floatv v1x, v2x, ly, r1, r2, R1, R2;
+  floatv minX, minY, maxX, maxY;
+  bool hasAperture, hasScreen;
+  floatv apX, apY, apHalfWidth, apHalfOpening;
+  floatv scX, scY, scHalfWidth, scHalfHeight;
+  floatv stepFactor, minTraceDist, maxTraceDist;
+
+  PacketKernel(const PacketScene &s, const PacketStep &step) {
+    zero = vbroadcast(0); one = vbroadcast(1); tolerance = vbroadcast(TOLERANCE);
+    v1x = vbroadcast(s.lensVertex1X); v2x = vbroadcast(s.lensVertex2X); ly = vbroadcast(s.lensY);
+    r1 = vbroadcast(s.lensR1); r2 = vbroadcast(s.lensR2);
+    R1 = vbroadcast(fabs(s.lensR1)); R2 = vbroadcast(fabs(s.lensR2));
+    minX = vbroadcast(s.bottomLeft.x); minY = vbroadcast(s.bottomLeft.y);
+    maxX = vbroadcast(s.topRight.x); maxY = vbroadcast(s.topRight.y);
+    hasAperture = s.hasAperture;
+    apX = vbroadcast(s.apertureX); apY = vbroadcast(s.apertureY);
+    apHalfWidth = vbroadcast(s.apertureHalfWidth);
+    apHalfOpening = vbroadcast(s.apertureHalfOpeningHeight);
+    hasScreen = s.hasScreen;
+    scX = vbroadcast(s.screenX); scY = vbroadcast(s.screenY);
+    scHalfWidth = vbroadcast(s.screenHalfWidth); scHalfHeight = vbroadcast(s.screenHalfHeight);
+    stepFactor = vbroadcast(step.stepFactor);
+    minTraceDist = vbroadcast(step.minTraceDist);
+    maxTraceDist = vbroadcast(step.maxTraceDist);
+  }
+
+  // signed distance to the circle of signed radius r through a vertex, from
+  // q = p - vertex: |q - c| - R as (|q - c|^2 - R^2) / (|q - c| + R), c = (r, 0),
+  // which stays precise near the surface for radii of 10^4 (see SDFLens).
+  floatv circleDist(floatv qx, floatv qy, floatv r, floatv R) const {
+    const floatv cx = qx - r;
+    return (qx * qx - (r + r) * qx + qy * qy) / (vsqrt(cx * cx + qy * qy) + R);
+  }
+
+  // max of the two circle distances; also reports which circle won for the normal.
+  floatv lensDist(floatv x, floatv y, maskv &firstWins) const {
+    const floatv qy = y - ly;
+    const floatv d1 = circleDist(x - v1x, qy, r1, R1);
+    const floatv d2 = circleDist(x - v2x, qy, r2, R2);
+    firstWins = vlt(d2, d1);
+    return vmax(d1, d2);
+  }
+
+  floatv lensDist(floatv x, floatv y) const {
+    maskv firstWins;
+    return lensDist(x, y, firstWins);
+  }
+
+  // the stops above and below the opening are boxes running off to infinity.
+  floatv apertureDist(floatv x, floatv y) const {
+    return packetBoxDist(vabs(x - apX) - apHalfWidth, apHalfOpening - vabs(y - apY));
+  }
+
+  floatv screenDist(floatv x, floatv y) const {
+    return packetBoxDist(vabs(x - scX) - scHalfWidth, vabs(y - scY) - scHalfHeight);
+  }
+
+  // the lanes in lanes cross the boundary of dist somewhere along
+  // (x, y) + t (dx, dy), t in [0, t1], where dist goes from f0 to f1 across
+  // it: refineCrossing (raymarch.h) lane by lane, regula falsi that bisects
+  // when it stalls. Returns the far end of each bracket, on f1's side within
+  // TOLERANCE of the surface, and t1 in the other lanes.
+  template<typename Dist>
+  floatv refine(Dist dist, maskv lanes, floatv x, floatv y, floatv dx, floatv dy,
+      floatv f0, floatv t1, floatv f1, long long &nevals) const {
+    const maskv insideFar = vle(f1, zero);
+    floatv t0 = zero;
+    maskv active = lanes & vlt(tolerance, t1 - t0);
+    // which end moved last, to halve the other end's weight.
+    maskv movedFar = vmaskfirst(0), movedNear = movedFar;
+    for(int iter = 0; iter < 32 && vany(active); ++iter) {
+      floatv t = (t0 * f1 - t1 * f0) / (f1 - f0);
+      // keep the guess inside the bracket, away from its ends.
+      t = vselect(vlt(t0, t) & vlt(t, t1), t, (t0 + t1) * vbroadcast(0.5f));
+      const floatv f = dist(x + dx * t, y + dy * t);
+      nevals += vcount(active);
+      const maskv otherSide = vle(f, zero) ^ insideFar;
+      const maskv far = vandnot(active, otherSide), near = active & otherSide;
+      t1 = vselect(far, t, t1);
+      f1 = vselect(far, f, f1);
+      f0 = vselect(far & movedFar, f0 * vbroadcast(0.5f), f0);
+      t0 = vselect(near, t, t0);
+      f0 = vselect(near, f, f0);
+      f1 = vselect(near & movedNear, f1 * vbroadcast(0.5f), f1);
+      movedFar = far;
+      movedNear = near;
+      active = vandnot(active, far & vle(vabs(f), tolerance)) & vlt(tolerance, t1 - t0);
+    }
+    return t1;
+  }
+
+  // one step of the lanes in alive at (px, py) heading (dx, dy). Lanes out of
+  // bounds, or in the aperture or screen, leave alive (the latter reported in
+  // hitAperture / hitScreen); the others advance by a share of the distance
+  // to the scene, or onto the lens or screen when the step would cross it.
+  // inGlass follows the lanes, and crossed reports those that changed
+  // medium, which bend() must turn.
+  void step(maskv &alive, floatv &px, floatv &py, floatv dx, floatv dy, maskv &inGlass,
+      maskv &hitAperture, maskv &hitScreen, maskv &crossed, long long &nevals) const {
+    hitAperture = hitScreen = crossed = vmaskfirst(0);
+    const maskv inbounds = vge(px, minX) & vge(py, minY) & vle(px, maxX) & vle(py, maxY);
+    alive = alive & inbounds;
+    const int nalive = vcount(alive);
+
+    floatv dist = maxTraceDist, ds = maxTraceDist;
+    if (hasAperture) {
+      const floatv da = apertureDist(px, py);
+      hitAperture = alive & vlt(da, zero);
+      alive = vandnot(alive, hitAperture);
+      dist = vmin(dist, vabs(da));
+      nevals += nalive;
+    }
+    if (hasScreen) {
+      ds = screenDist(px, py);
+      hitScreen = alive & vlt(ds, zero);
+      alive = vandnot(alive, hitScreen);
+      dist = vmin(dist, vabs(ds));
+      nevals += nalive;
+    }
+    if (!vany(alive)) { return; }
+
+    // use distance to glass to decide length of ray.
+    const floatv dg = lensDist(px, py);
+    dist = vmin(dist, vabs(dg));
+    const floatv rayLength = vmax(dist * stepFactor, minTraceDist);
+    const floatv nx = px + dx * rayLength;
+    const floatv ny = py + dy * rayLength;
+    const floatv dgNext = lensDist(nx, ny);
+    const maskv inGlassNext = vle(dgNext, zero);
+    nevals += 2 * vcount(alive);
+
+    crossed = alive & (inGlass ^ inGlassNext);
+    floatv t = rayLength;
+    if (vany(crossed)) {
+      t = refine([this](floatv x, floatv y) { return lensDist(x, y); },
+          crossed, px, py, dx, dy, dg, rayLength, dgNext, nevals);
+    }
+    if (hasScreen) {
+      // stop just inside the screen, where the next step finds the hit.
+      const floatv dsNext = screenDist(nx, ny);
+      const maskv entered = vandnot(alive & vlt(dsNext, zero), crossed);
+      nevals += vcount(alive);
+      if (vany(entered)) {
+        t = refine([this](floatv x, floatv y) { return screenDist(x, y); },
+            entered, px, py, dx, dy, ds, t, dsNext, nevals);
+      }
+    }
+    px = vselect(alive, px + dx * t, px);
+    py = vselect(alive, py + dy * t, py);
+    inGlass = (alive & inGlassNext) | vandnot(inGlass, alive);
+  }
+
+  // turn the lanes in lanes, which just crossed the lens at (x, y), from a
+  // medium of index indexCur into one of indexNext: Snell's law, or total
+  // internal reflection, reported in isTir.
+  void bend(maskv lanes, floatv x, floatv y, floatv &dx, floatv &dy,
+      floatv indexCur, floatv indexNext, maskv &isTir) const {
+    maskv firstWins;
+    lensDist(x, y, firstWins);
+    // from the center of curvature of the nearer surface, its vertex + (r, 0).
+    const floatv ox = x - vselect(firstWins, v1x, v2x) - vselect(firstWins, r1, r2);
+    const floatv oy = y - ly;
+    const floatv olen = vsqrt(ox * ox + oy * oy);
+    // normal inward.
+    const floatv inx = zero - ox / olen;
+    const floatv iny = zero - oy / olen;
+    const floatv cosIn = inx * dx + iny * dy;
+
+    const floatv projx = inx * cosIn, projy = iny * cosIn;
+    const floatv rejx = dx - projx, rejy = dy - projy;
+
+    const floatv sinIn = vsqrt(vmax(one - cosIn * cosIn, zero));
+    const floatv sinOut = sinIn * indexCur / indexNext;
+    isTir = lanes & vge(vabs(sinOut), one);
+
+    // total internal reflection flips the normal component, refraction rescales it.
+    const floatv cosOut = vsqrt(vmax(one - sinOut * sinOut, zero));
+    const floatv newx = vselect(isTir, rejx - projx - projx, projx * cosOut + rejx * sinOut);
+    const floatv newy = vselect(isTir, rejy - projy - projy, projy * cosOut + rejy * sinOut);
+    const floatv newlen = vsqrt(newx * newx + newy * newy);
+    dx = vselect(lanes, newx / newlen, dx);
+    dy = vselect(lanes, newy / newlen, dy);
+  }
+};
+
+// trace PACKET_WIDTH rays starting at starts[0..n), n <= PACKET_WIDTH.
+// indices[0..n) is the glass index of each lane, s.refractiveIndex for all when null.
+static void tracePacketLanes(const PacketScene &s, const PacketStep &step,
+    const Vector2 *starts, const Vector2 *dirs, int n, PacketRayResult *out, TraceStats *stats,
+    const float *indices = nullptr) {
+  float buf[4][PACKET_WIDTH] = {};
+  float laneIndex[PACKET_WIDTH];
+  for(int l = 0; l < PACKET_WIDTH; ++l) {
+    laneIndex[l] = indices && l < n ? indices[l] : s.refractiveIndex;
+  }
+  for(int l = 0; l < n; ++l) {
+    const Vector2 dir = Vector2Normalize(dirs[l]);
+    buf[0][l] = starts[l].x; buf[1][l] = starts[l].y;
+    buf[2][l] = dir.x; buf[3][l] = dir.y;
+  }
+  floatv px = vload(buf[0]), py = vload(buf[1]);
+  floatv dx = vload(buf[2]), dy = vload(buf[3]);
+
+  const PacketKernel k(s, step);
+  const floatv glassIndex = vload(laneIndex);
+
+  maskv alive = vmaskfirst(n);
+  maskv inGlass = vle(k.lensDist(px, py), k.zero);
+  maskv refracted = vmaskfirst(0), tir = refracted;
+  maskv hitAperture = refracted, hitScreen = refracted;
+  floatv nsteps = k.zero;
+  long long nevals = n;
+
+  for(int istep = 1; istep <= step.nsteps && vany(alive); ++istep) {
+    nsteps = nsteps + vselect(alive, k.one, k.zero);
+    maskv stepAperture, stepScreen, crossed;
+    k.step(alive, px, py, dx, dy, inGlass, stepAperture, stepScreen, crossed, nevals);
+    hitAperture = hitAperture | stepAperture;
+    hitScreen = hitScreen | stepScreen;
+
+    // lanes that changed medium bend their direction.
+    if (vany(crossed)) {
+      nevals += vcount(crossed);
+      // the lanes are already in their new medium; they came from the other one.
+      const floatv indexCur = vselect(inGlass, k.one, glassIndex);
+      const floatv indexNext = vselect(inGlass, glassIndex, k.one);
+      maskv isTir;
+      k.bend(crossed, px, py, dx, dy, indexCur, indexNext, isTir);
+      tir = tir | isTir;
+      refracted = refracted | vandnot(crossed, isTir);
+    }
+  }
+
+  vstore(buf[0], px); vstore(buf[1], py);
+  vstore(buf[2], dx); vstore(buf[3], dy);
+  float steps[PACKET_WIDTH];
+  vstore(steps, nsteps);
+  const int refractedBits = vbits(refracted), tirBits = vbits(tir);
+  const int apertureBits = vbits(hitAperture), screenBits = vbits(hitScreen);
+  for(int l = 0; l < n; ++l) {
+    PacketRayResult &r = out[l];
+    r.point = v2(buf[0][l], buf[1][l]);
+    r.dir = v2(buf[2][l], buf[3][l]);
+    r.nsteps = steps[l];
+    r.refracted = (refractedBits >> l) & 1;
+    r.totalInternalReflected = (tirBits >> l) & 1;
+    r.intersectedAperture = (apertureBits >> l) & 1;
+    r.intersectedScreen = (screenBits >> l) & 1;
+  }
+  if (stats) {
+    stats->nrays += n;
+    for(int l = 0; l < n; ++l) {
+      stats->nsteps += out[l].nsteps;
+      stats->ndetected += out[l].intersectedScreen;
+    }
+    stats->nsdfEvals += nevals;
+  }
+}
+
+// trace n rays, PACKET_WIDTH at a time, with the glass indices of tracePacketLanes.
+static void tracePacket(const PacketScene &s, const PacketStep &step,
+    const Vector2 *starts, const Vector2 *dirs, int n, PacketRayResult *out, TraceStats *stats,
+    const float *indices = nullptr) {
+  for(int i = 0; i < n; i += PACKET_WIDTH) {
+    tracePacketLanes(s, step, starts + i, dirs + i, std::min<int>(PACKET_WIDTH, n - i), out + i, stats,
+        indices ? indices + i : nullptr);
+  }
+}
@@ -0,0 +1,63 @@
+#pragma once
+// frame-scoped storage for recorded ray paths.
+//
+// Instead of a std::vector per ray, every path is appended to one vertex
+// array and the ray keeps an (offset, count) reference into it, CSR style.
+// There is one array per pool participant, so tracing threads never share
+// one. reset() empties the arrays but keeps their capacity, so after the first
+// frames recording a path does not allocate.
+#include "raymarch.h"
+#include <vector>
+
+struct PathRef {
+  int region = 0;
+  int offset = 0;
+  int count = 0;
+};
+
+struct PathArena {
+  std::vector<std::vector<Vector2>> regions;
+
+  void reset(int nregions) {
+    if ((int)regions.size() < nregions) { regions.resize(nregions); }
+    for(std::vector<Vector2> &r : regions) { r.clear(); }
+  }
+
+  const Vector2 *points(PathRef path) const { return regions[path.region].data() + path.offset; }
+  Vector2 last(PathRef path) const { return points(path)[path.count - 1]; }
+};
+
+// recorder that appends every march point to a region of an arena.
+struct PathRecord : public NoRecord {
+  std::vector<Vector2> *region = nullptr;
+  PathRef path;
+
+  void begin(PathArena &arena, int iregion) {
+    region = &arena.regions[iregion];
+    path.region = iregion;
+    path.offset = region->size();
+    path.count = 0;
+  }
+
+  void onPoint(Vector2 point) {
+    region->push_back(point);
+    path.count++;
+  }
+};
+
+// recorder that keeps only the vertices of the path: where it starts, where
+// it changes medium, and where it ends. Every medium is homogeneous, so the
+// points in between are collinear and the drawn path is the same.
+struct InterfacePathRecord : public PathRecord {
+  void onPoint(Vector2 point) {
+    if (path.count == 0) { PathRecord::onPoint(point); }
+  }
+
+  void onInterface(Vector2 point) { PathRecord::onPoint(point); }
+
+  void onEnd(Vector2 point) {
+    if (path.count == 0 || !Vector2Equals(region->back(), point)) {
+      PathRecord::onPoint(point);
+    }
+  }
+};
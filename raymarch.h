@@ -0,0 +1,313 @@
+#pragma once
+// ray marching engine shared by all scenes.
+//
+// The loop is templated on three compile-time policies:
+//   Step      - NSTEPS, how far to advance given the distance to the scene,
+//               and whether to use closed-form crossings (ANALYTIC).
+//   Recorder  - what to remember about the ray (points, flags, counters).
+//   Sink      - what to draw while tracing.
+// Recorders and sinks derive from NoRecord / NoDraw and hide only the hooks
+// they care about, so NoRecord + NoDraw compiles to a bare loop.
+//
+// Every step makes exactly one scene query (sceneQuery), at the point the ray
+// advances to; its distance sizes the next step. A step that changes medium
+// has overshot a boundary: the crossing is refined onto the surface (to
+// TOLERANCE) before the normal is taken there, so hit points do not depend on
+// how coarse the steps near surfaces are.
+//
+// When Step::ANALYTIC is set and every shape in the scene has a closed-form
+// intersectRay, there is no marching: each step makes one sceneIntersectRay
+// instead, jumps straight past the next boundary crossing (or out of bounds
+// when there is none), and takes the normal from the crossing.
+#include "optics.h"
+#include "sdfbvh.h"
+#include <float.h>
+
+struct NoRecord {
+  // called at the start of every step, before the bounds check.
+  void onPoint(Vector2 point) {}
+  // called where the ray changes direction at a change of medium, before the
+  // matching onReflect / onRefract / onTotalInternalReflection.
+  void onInterface(Vector2 point) {}
+  // called once with the last point of the ray, however it stopped.
+  void onEnd(Vector2 point) {}
+  void onReflect() {}
+  void onRefract() {}
+  void onTotalInternalReflection() {}
+  // absorbed by an Opaque element.
+  void onOpaque() {}
+  // absorbed by a Detector element.
+  void onDetect(int element) {}
+};
+
+struct NoDraw {
+  // called with the point the ray is about to advance to.
+  void onNextPoint(Vector2 pointNext) {}
+  void onSegment(Vector2 pointCur, Vector2 pointNext, int isteps) {}
+  void onOpaque(Vector2 point) {}
+};
+
+// draw every march step as a thick line, optionally fading out with the step count.
+struct LineDraw : public NoDraw {
+  Color color;
+  float thickness;
+  int fadeSteps; // 0 to keep color.a constant.
+  bool drawNextPoint = false;
+
+  LineDraw(Color color, float thickness, int fadeSteps) :
+    color(color), thickness(thickness), fadeSteps(fadeSteps) {};
+
+  void onNextPoint(Vector2 pointNext) {
+    // draw a circle showing how we shot the ray.
+    if (drawNextPoint) { DrawCircle(pointNext.x, pointNext.y, 10, {100, 100, 100, 50}); }
+  }
+
+  void onSegment(Vector2 pointCur, Vector2 pointNext, int isteps) {
+    Color c = color;
+    if (fadeSteps) { c.a = 255 * (1.0f - ((float)(isteps) / fadeSteps)); }
+    DrawLineEx(pointCur, pointNext, thickness, c);
+  }
+
+  void onOpaque(Vector2 point) {
+    DrawCircle(point.x, point.y, 3, BLACK);
+  }
+};
+
+// one evaluation of the scene at point: the nearest element, its distance,
+// and the medium the point is in.
+static SceneHit sceneQuery(Scene s, Vector2 point) {
+  if (s.stats) { s.stats->nsdfEvals++; }
+  SceneHit hit;
+  if (s.nelements == 0) {
+    hit.dist = s.glassSDF->valueAt(point);
+    hit.element = -1;
+    hit.material = materialAtGlassDist(hit.dist);
+    return hit;
+  }
+  // one traversal of the tree finds the nearest element and its distance.
+  assert(s.bvh && "scene elements are queried through their bvh");
+  hit.dist = s.bvh->nearest(point, &hit.element);
+  hit.material = hit.dist > 0 ? materialAir() : s.elements[hit.element].material;
+  return hit;
+}
+
+// the element whose boundary lies between from and to: the one being
+// entered, or else the one being left. -1 for a glassSDF scene.
+static int sceneCrossedElement(Scene s, SceneHit from, SceneHit to) {
+  if (s.nelements == 0) { return -1; }
+  return to.dist <= 0 ? to.element : from.element;
+}
+
+// signed distance to one element (-1: the glass) alone.
+static float sceneElementValue(Scene s, int element, Vector2 point) {
+  if (s.stats) { s.stats->nsdfEvals++; }
+  if (element < 0) { return s.glassSDF->valueAt(point); }
+  return s.elements[element].sdf->valueAt(point);
+}
+
+// outward direction at point of the boundary crossed between from and to.
+static Vector2 sceneNormal(Scene s, SceneHit from, SceneHit to, Vector2 point) {
+  if (s.stats) { s.stats->nsdfEvals++; }
+  const int element = sceneCrossedElement(s, from, to);
+  if (element < 0) {
+    return s.glassSDF->eval(point).dirOutward;
+  }
+  return s.elements[element].sdf->eval(point).dirOutward;
+}
+
+// the nearest boundary crossing of the ray start + t dir, t > 0, in closed
+// form, and the element it belongs to (-1: the glass). false unless every
+// shape in the scene has an intersectRay.
+static bool sceneIntersectRay(Scene s, Vector2 start, Vector2 dir, RayCrossing &crossing, int &element) {
+  element = -1;
+  if (s.nelements == 0) {
+    if (!s.glassSDF->intersectRay(start, dir, 0, crossing)) { return false; }
+  } else {
+    assert(s.bvh && "scene elements need an SDFBVH");
+    if (!s.bvh->intersectRay(start, dir, 0, crossing, &element)) { return false; }
+  }
+  if (s.stats) { s.stats->nsdfEvals++; }
+  return true;
+}
+
+// the medium just past a crossing of element's boundary along dir: the
+// element's when the ray enters it, air when it leaves (elements sit in air).
+static SceneHit sceneCrossingHit(Scene s, RayCrossing crossing, int element, Vector2 dir) {
+  SceneHit hit;
+  hit.element = element;
+  if (Vector2DotProduct(dir, crossing.normalOutward) >= 0) {
+    hit.material = materialAir();
+  } else {
+    hit.material = element < 0 ? materialGlass() : s.elements[element].material;
+  }
+  return hit;
+}
+
+// the sides of a boundary, as the material test sees them.
+static inline bool sceneInside(float dist) { return dist <= 0; }
+
+// the boundary of element crosses the ray start + t dir somewhere in [t0, t1],
+// where its distance goes from f0 to f1 across the surface. Narrows the bracket
+// with regula falsi (Illinois variant, bisecting when it stalls) until the far
+// end is within TOLERANCE of the surface, or the bracket is TOLERANCE wide, and
+// returns the far end: on f1's side of the surface.
+static float refineCrossing(Scene s, int element, Vector2 start, Vector2 dir,
+    float t0, float f0, float t1, float f1) {
+  const bool insideFar = sceneInside(f1);
+  int side = 0; // which end moved last, to halve the other end's weight.
+  for(int iter = 0; iter < 32 && t1 - t0 > TOLERANCE; ++iter) {
+    float t = (t0 * f1 - t1 * f0) / (f1 - f0);
+    // keep the guess inside the bracket, away from its ends.
+    if (!(t > t0 && t < t1)) { t = 0.5f * (t0 + t1); }
+    const float f = sceneElementValue(s, element, Vector2Add(start, Vector2Scale(dir, t)));
+    if (sceneInside(f) == insideFar) {
+      t1 = t; f1 = f;
+      if (fabs(f) <= TOLERANCE) { break; }
+      if (side == 1) { f0 *= 0.5f; }
+      side = 1;
+    } else {
+      t0 = t; f0 = f;
+      if (side == -1) { f1 *= 0.5f; }
+      side = -1;
+    }
+  }
+  return t1;
+}
+
+// ends the ray at point when hit is inside an Opaque or Detector element:
+// where it enters one, or where it starts inside one. false otherwise.
+template<typename Recorder, typename Sink>
+static bool rayAbsorbed(Scene s, SceneHit hit, Vector2 point, Recorder &recorder, Sink &sink) {
+  if (hit.material.kind == OpticMaterialKind::Opaque) {
+    sink.onOpaque(point);
+    recorder.onOpaque();
+  } else if (hit.material.kind == OpticMaterialKind::Detector) {
+    if (s.stats) { s.stats->ndetected++; }
+    recorder.onDetect(hit.element);
+  } else {
+    return false;
+  }
+  recorder.onEnd(point);
+  return true;
+}
+
+template<typename Step, typename Recorder, typename Sink>
+static void raymarch(Scene s, Vector2 start, Vector2 dir, Vector2 bottomLeft, Vector2 topRight,
+    Recorder &recorder, Sink &sink) {
+  dir = Vector2Normalize(dir);
+  Vector2 pointCur = start;
+  SceneHit hitCur = sceneQuery(s, start);
+  if (s.stats) { s.stats->nrays++; }
+  if (rayAbsorbed(s, hitCur, start, recorder, sink)) { return; }
+  // the first closed-form query finds out whether the scene has them, and
+  // serves the first step.
+  RayCrossing crossing;
+  int crossed = -1;
+  const bool analytic = Step::ANALYTIC && sceneIntersectRay(s, start, dir, crossing, crossed);
+
+  for(int isteps = 1; isteps <= Step::NSTEPS; isteps++) {
+    if (s.stats) { s.stats->nsteps++; }
+    recorder.onPoint(pointCur);
+    if (!inbounds(bottomLeft, pointCur, topRight)) {
+      recorder.onEnd(pointCur);
+      return;
+    }
+
+    const OpticMaterial matCur = hitCur.material;
+    Vector2 pointNext;
+    SceneHit hitNext;
+    if (analytic) {
+      if (isteps > 1) { sceneIntersectRay(s, pointCur, dir, crossing, crossed); }
+      if (crossing.t < FLT_MAX) {
+        // just past the crossing, on its far side.
+        pointNext = Vector2Add(pointCur, Vector2Scale(dir, crossing.t + TOLERANCE));
+        hitNext = sceneCrossingHit(s, crossing, crossed, dir);
+      } else {
+        // nothing left to hit: straight out of bounds.
+        RayCrossing exit;
+        boxIntersectRay(bottomLeft, topRight, pointCur, dir, 0, exit);
+        pointNext = Vector2Add(pointCur, Vector2Scale(dir, (exit.t < FLT_MAX ? exit.t : 0) + TOLERANCE));
+        hitNext = hitCur;
+      }
+    } else {
+      // use distance to the scene, carried over from the last step, to decide length of ray.
+      const float rayLength = Step::rayLength(hitCur.dist);
+      pointNext = Vector2Add(pointCur, Vector2Scale(dir, rayLength));
+      hitNext = sceneQuery(s, pointNext);
+
+      // the step crossed a boundary somewhere: move pointNext onto it.
+      if (hitNext.material != matCur) {
+        const int element = sceneCrossedElement(s, hitCur, hitNext);
+        const float f0 = element == hitCur.element ? hitCur.dist : sceneElementValue(s, element, pointCur);
+        const float f1 = element == hitNext.element ? hitNext.dist : sceneElementValue(s, element, pointNext);
+        if (sceneInside(f0) != sceneInside(f1)) {
+          const float t = refineCrossing(s, element, pointCur, dir, 0, f0, rayLength, f1);
+          if (t < rayLength) {
+            pointNext = Vector2Add(pointCur, Vector2Scale(dir, t));
+            hitNext = sceneQuery(s, pointNext);
+          }
+        }
+      }
+    }
+    const OpticMaterial matNext = hitNext.material;
+    sink.onNextPoint(pointNext);
+
+    // refraction happened, we need to bend the direction now.
+    if (matNext != matCur) {
+      // change of medium.
+      if (rayAbsorbed(s, hitNext, pointNext, recorder, sink)) { return; }
+
+      Vector2 normalOut = Vector2Normalize(analytic ? crossing.normalOutward :
+          sceneNormal(s, hitCur, hitNext, pointNext));
+      // normal inward.
+      Vector2 normalIn = Vector2Normalize(Vector2Negate(normalOut));
+      const float cosIn = Vector2DotProduct(normalIn, dir);
+
+      // decompose dir into dirProjNormalIn, dirRejNormalIn
+      Vector2 dirProjNormalIn = Vector2Scale(normalIn, cosIn);
+      Vector2 dirRejNormalIn = Vector2Subtract(dir, dirProjNormalIn);
+
+      const float sinIn = sqrtf(std::max<float>(1.0f - cosIn * cosIn, 0));
+      const float conservedIn = sinIn * matCur.indexAt(s.wavelength);
+      const float sinOut = conservedIn / matNext.indexAt(s.wavelength);
+
+      recorder.onInterface(pointNext);
+      if (matNext.kind == OpticMaterialKind::Reflective) {
+        // reflective.
+        recorder.onReflect();
+        dir = Vector2Normalize(Vector2Add(dirRejNormalIn, Vector2Scale(dirProjNormalIn, -2)));
+
+      } else if (matNext.kind == OpticMaterialKind::Refractive) {
+        if (fabs(sinOut) >= 1) {
+          // total internal reflection.
+          recorder.onTotalInternalReflection();
+          dir = Vector2Normalize(Vector2Add(dirRejNormalIn, Vector2Scale(dirProjNormalIn, -2)));
+        } else {
+          // refraction..
+          recorder.onRefract();
+          const float cosOut = sqrt(1 - sinOut * sinOut);
+          Vector2 newDir = Vector2Add(Vector2Scale(dirProjNormalIn, cosOut), Vector2Scale(dirRejNormalIn, sinOut));
+          dir = Vector2Normalize(newDir);
+        } // end (sinOut > 1)
+      } else {
+        assert(false && "unknown MaterialKind.");
+      }
+    }
+    sink.onSegment(pointCur, pointNext, isteps);
+    pointCur = pointNext;
+    hitCur = hitNext;
+  }
+  recorder.onEnd(pointCur);
+}
+
+// trace with sink when the scene draws, and with the headless NoDraw instantiation otherwise.
+template<typename Step, typename Recorder, typename Sink>
+static void raymarchMaybeDraw(Scene s, Vector2 start, Vector2 dir, Vector2 bottomLeft, Vector2 topRight,
+    Recorder &recorder, Sink &sink) {
+  if (s.draw) {
+    raymarch<Step>(s, start, dir, bottomLeft, topRight, recorder, sink);
+  } else {
+    NoDraw nodraw;
+    raymarch<Step>(s, start, dir, bottomLeft, topRight, recorder, nodraw);
+  }
+}
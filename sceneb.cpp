@@ -1,91 +1,40 @@
 // scene that uses the SDF to decide how to bounce light.
-#include "optics.h"
+#include "raymarch.h"
+#include "sdftape.h"
+#include "sdfgrid.h"
+#include "fan.h"
 
 
 static bool DrawCircleAtNextPoint = false;
 
-static void raytrace(Scene s, Vector2 start, Vector2 dir, Vector2 bottomLeft, Vector2 topRight) {
-  const float MIN_TRACE_DIST = 1;
-  dir = Vector2Normalize(dir);
-  Vector2 pointCur = start;
-  OpticMaterial matCur = materialQuery(s, start);
-
-  const int NSTEPS = 30;
-  static int maxSteps = 1;
-  for(int isteps = 1; isteps <= NSTEPS; isteps++) {
-    if (!inbounds(bottomLeft, pointCur, topRight)) { 
-      maxSteps = std::max<int>(maxSteps, isteps);
-      printf("stopped in max %5d steps\n", maxSteps);
-      return;
-    }
-
-    // use distance to glass to decide length of ray.
-    const float distToGlass = s.glassSDF->valueAt(pointCur);
-    const float rayLength = std::max<float>(fabs(distToGlass) * 0.75, MIN_TRACE_DIST);
-    Vector2 pointNext = Vector2Add(pointCur, Vector2Scale(dir, rayLength));
-    OpticMaterial matNext = materialQuery(s, pointNext);
-
-    // draw a circle showing how we shot the ray.
-    if (DrawCircleAtNextPoint) { DrawCircle(pointNext.x, pointNext.y, 10, {100, 100, 100, 50}); }
-
-    // refraction happened, we need to bend the direction now.
-    if (matNext != matCur) {
-      // change of medium.
-
-      Vector2 normalOut = Vector2Normalize(s.glassSDF->dirOutwardAt(pointNext));
-      // normal inward.
-      Vector2 normalIn = Vector2Normalize(Vector2Negate(normalOut)); 
-      const float cosIn = Vector2DotProduct(normalIn, dir);
-
-      // decompose dir into dirProjNormalIn, dirRejNormalIn
-      Vector2 dirProjNormalIn = Vector2Scale(normalIn, cosIn);
-      Vector2 dirRejNormalIn = Vector2Subtract(dir, dirProjNormalIn);
-
-      const float sinIn = sqrtf(1.0f - cosIn * cosIn);
-      const float conservedIn = sinIn * matCur.refractiveIndex;
-      const float sinOut = conservedIn / matNext.refractiveIndex;
-
-
-      // only care if the angle is less than 90 degrees.
-      if (true || cosIn > 0) {
-        if (matNext.kind == OpticMaterialKind::Opaque) {
-          //opaque, stop.
-          DrawCircle(pointNext.x, pointNext.y, 3, BLACK);
-          return;
-        }
-        else if (matNext.kind == OpticMaterialKind::Reflective) {
-          // reflective.
-          dir = Vector2Normalize(Vector2Add(dirRejNormalIn, Vector2Scale(dirProjNormalIn, -2)));
-
-        } else if (matNext.kind == OpticMaterialKind::Refractive) {
-          if (fabs(sinOut) >= 1) {
-            // total internal reflection.
-            dir = Vector2Normalize(Vector2Add(dirRejNormalIn, Vector2Scale(dirProjNormalIn, -2)));
-            // DrawCircle(pointNext.x, pointNext.y, 2, (Color) {177, 175, 255, 255}); // total internal reflection color
-          } else {
-            // refraction..
-            const float cosOut = sqrt(1 - sinOut * sinOut);
-            Vector2 newDir = Vector2Add(Vector2Scale(dirProjNormalIn, cosOut), Vector2Scale(dirRejNormalIn, sinOut));
-            dir = Vector2Normalize(newDir);
-          } // end (sinOut > 1)
-        } else {
-          assert(false && "unknown MaterialKind.");
-        }
-      } // end (cosIn > 0)
-    }
-    Color c = { 120, 160, 131, 255}; // light ray color
-    c.a = 255 * (1.0f - ((float)(isteps) / NSTEPS));
-    DrawLineEx(pointCur, pointNext, 4, c);
-    pointCur = pointNext;
-    matCur = matNext;
+struct SceneBStep {
+  static constexpr int NSTEPS = 30;
+  static constexpr float MIN_TRACE_DIST = 1;
+  static constexpr bool ANALYTIC = false;
+  static float rayLength(float dist) {
+    return std::max<float>(fabs(dist) * 0.75, MIN_TRACE_DIST);
   }
-  return;
+};
+
+static FanSample raytrace(Scene s, float theta, Vector2 start, Vector2 bottomLeft, Vector2 topRight) {
+  FanRecord record;
+  LineDraw sink({ 120, 160, 131, 255}, 4, SceneBStep::NSTEPS); // light ray color
+  sink.drawNextPoint = DrawCircleAtNextPoint;
+  raymarchMaybeDraw<SceneBStep>(s, start, v2(cos(theta), sin(theta)), bottomLeft, topRight, record, sink);
+  return record.sample(theta);
 }
 
 
 typedef struct {
   SDFCircle *circleLeft, *circleRight;
   SDFIntersect *lens;
+  SDFTape lensTape; // lens flattened for tracing, recompiled on layout.
+  SDFGrid lensGrid; // lensTape sampled on a grid, marched through when useGrid.
+  bool useGrid;
+  bool adaptive; // refine a coarse fan where rays bend instead of shooting NRAYS.
+  std::vector<FanSample> fan;
+  Vector2 lensGridSize; // screen size and lens thickness the grid was built for.
+  float lensGridThickness;
   float lensRadius;
   float lensThickness;
   Vector2 lensCenter;
@@ -99,41 +48,104 @@ void* sceneB_init(void) {
     data->circleLeft = new SDFCircle();
     data->circleRight = new SDFCircle();
     data->lens = new SDFIntersect(data->circleLeft, data->circleRight);
+    data->lensGridSize = v2(0, 0);
+    data->lensGridThickness = -1;
+    data->useGrid = false;
+    data->adaptive = false;
     return data;
 };
 
 
-void sceneB_draw(void *raw_data) {
-    sceneBData *data = (sceneBData*)raw_data;
-    
-
-    if (IsKeyPressed(KEY_SPACE)) {
-      DrawCircleAtNextPoint = !DrawCircleAtNextPoint;
-    }
-
-    int midX = GetScreenWidth() / 2;
-    int midY = GetScreenHeight() / 2;
+static void sceneB_layout(sceneBData *data, int screenWidth, int screenHeight) {
+    int midX = screenWidth / 2;
+    int midY = screenHeight / 2;
 
     // update SDF
-    data->lensThickness = std::max<int>(0, data->lensThickness + GetMouseWheelMove());
     data->circleLeft->radius = data->lensRadius;
     data->circleRight->radius = data->lensRadius;
     data->circleLeft->center.y = data->circleRight->center.y = midY;
     data->circleLeft->center.x = midX - data->lensRadius + data->lensThickness;
     data->circleRight->center.x = midX + data->lensRadius - data->lensThickness;
+    data->lensTape.compile(data->lens);
+
+    // the lens only moves with the mouse wheel or a resize, resample then.
+    const float GRID_CELL = 4;
+    if (data->useGrid && (data->lensGridThickness != data->lensThickness ||
+        data->lensGridSize.x != screenWidth || data->lensGridSize.y != screenHeight)) {
+      data->lensGrid.build(&data->lensTape, v2(0, 0), v2(screenWidth, screenHeight), GRID_CELL);
+      data->lensGridThickness = data->lensThickness;
+      data->lensGridSize = v2(screenWidth, screenHeight);
+    }
+}
 
-    BeginDrawing();
-    ClearBackground({240, 240, 240, 255});
-    Scene s; s.glassSDF = data->lens;
+// two circles are as cheap as a grid lookup, the grid pays off on bigger trees.
+static SDF *sceneB_glass(sceneBData *data) {
+    if (data->useGrid) { return &data->lensGrid; }
+    return &data->lensTape;
+}
 
+static void sceneB_trace(sceneBData *data, Scene s, Vector2 source, int screenWidth, int screenHeight) {
     const int NRAYS = 360;
-    const Vector2 mousePos = GetMousePosition();
+    if (data->adaptive) {
+      FanTolerance tol;
+      tol.deflection = 0.05;
+      tol.minAngle = (M_PI * 2) / (NRAYS * 4);
+      adaptiveFan(0, M_PI * 2, NRAYS / 8, tol, [&](float theta) {
+        return raytrace(s, theta, source, v2(0, 0), v2(screenWidth, screenHeight));
+      }, data->fan);
+      return;
+    }
     for(float theta = 0; theta < M_PI * 2; theta += (M_PI * 2)/NRAYS) {
-      std::pair<Vector2, bool> out;
-      Vector2 raydir = v2(cos(theta), sin(theta));
-      raytrace(s, mousePos, raydir, v2(0, 0), v2(GetScreenWidth(), GetScreenHeight()));
+      raytrace(s, theta, source, v2(0, 0), v2(screenWidth, screenHeight));
+    }
+}
+
+void sceneB_draw(void *raw_data) {
+    sceneBData *data = (sceneBData*)raw_data;
+
+    if (IsKeyPressed(KEY_SPACE)) {
+      DrawCircleAtNextPoint = !DrawCircleAtNextPoint;
     }
+    if (IsKeyPressed(KEY_G)) {
+      data->useGrid = !data->useGrid;
+    }
+    if (IsKeyPressed(KEY_A)) {
+      data->adaptive = !data->adaptive;
+    }
+
+    data->lensThickness = std::max<int>(0, data->lensThickness + GetMouseWheelMove());
+    sceneB_layout(data, GetScreenWidth(), GetScreenHeight());
+
+    BeginDrawing();
+    ClearBackground({240, 240, 240, 255});
+    Scene s; s.glassSDF = sceneB_glass(data);
+    sceneB_trace(data, s, GetMousePosition(), GetScreenWidth(), GetScreenHeight());
 
     DrawFPS(10, 10);
     EndDrawing();
 }
+
+void sceneB_bench(void *raw_data, BenchParams params, TraceStats *stats) {
+    sceneBData *data = (sceneBData*)raw_data;
+    data->lensThickness = params.lensThickness;
+    sceneB_layout(data, params.screenWidth, params.screenHeight);
+
+    Scene s; s.glassSDF = sceneB_glass(data); s.draw = false; s.stats = stats;
+    sceneB_trace(data, s, params.source, params.screenWidth, params.screenHeight);
+}
+
+// sceneB_bench, marching through the sampled grid.
+void sceneB_benchGrid(void *raw_data, BenchParams params, TraceStats *stats) {
+    sceneBData *data = (sceneBData*)raw_data;
+    data->useGrid = true;
+    sceneB_bench(raw_data, params, stats);
+    data->useGrid = false;
+}
+
+// sceneB_bench, with the adaptive fan.
+void sceneB_benchAdaptive(void *raw_data, BenchParams params, TraceStats *stats) {
+    sceneBData *data = (sceneBData*)raw_data;
+    data->adaptive = true;
+    sceneB_bench(raw_data, params, stats);
+    data->adaptive = false;
+}
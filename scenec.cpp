@@ -1,108 +1,90 @@
 // scene where light rays are importance sampled, slowly.
-#include "optics.h"
-
-struct RaytraceResults {
+#include "raymarch.h"
+#include "sdftape.h"
+#include "accum.h"
+#include "threadpool.h"
+#include "importance.h"
+#include "mcmc.h"
+
+struct RaytraceResults : public NoRecord {
   int nreflections = 0;
   int nrefractions = 0;
   int nsteps = 0;
 
+  void onPoint(Vector2 point) { nsteps++; }
+  void onReflect() { nreflections++; }
+  void onRefract() { nrefractions++; }
+  void onTotalInternalReflection() { nrefractions++; }
+
   float getImportance() {
     return  nsteps;
 
   }
 };
 
-static RaytraceResults raytrace(Scene s, Vector2 start, Vector2 dir, Vector2 bottomLeft, Vector2 topRight) {
-  RaytraceResults results;
-  const float MIN_TRACE_DIST = 1;
-  dir = Vector2Normalize(dir);
-  Vector2 pointCur = start;
-  OpticMaterial matCur = materialQuery(s, start);
-
-  const int NSTEPS = 100;
-  static int maxSteps = 1;
-  for(int isteps = 1; isteps <= NSTEPS; isteps++) {
-    results.nsteps++;
-    if (!inbounds(bottomLeft, pointCur, topRight)) { 
-      return results;
-    }
+struct SceneCStep {
+  static constexpr int NSTEPS = 100;
+  static constexpr float MIN_TRACE_DIST = 1;
+  // marches, so the C row times the lens tape; a jump would bypass it.
+  static constexpr bool ANALYTIC = false;
+  static float rayLength(float dist) {
+    return std::max<float>(MIN_TRACE_DIST, 0.8 * dist);
+  }
+};
 
-    // use distance to glass to decide length of ray.
-    const float distToGlass = s.glassSDF->valueAt(pointCur);
-    const float rayLength = std::max<float>(MIN_TRACE_DIST, 0.8 * distToGlass);
-    Vector2 pointNext = Vector2Add(pointCur, Vector2Scale(dir, rayLength));
-    OpticMaterial matNext = materialQuery(s, pointNext);
-
-    // draw a circle showing how we shot the ray.
-    // DrawCircle(pointNext.x, pointNext.y, 3, {100, 100, 100, 50});
-
-    // refraction happened, we need to bend the direction now.
-    if (matNext != matCur) {
-      // change of medium.
-
-      Vector2 normalOut = Vector2Normalize(s.glassSDF->dirOutwardAt(pointNext));
-      // normal inward.
-      Vector2 normalIn = Vector2Normalize(Vector2Negate(normalOut)); 
-      const float cosIn = Vector2DotProduct(normalIn, dir);
-
-      // decompose dir into dirProjNormalIn, dirRejNormalIn
-      Vector2 dirProjNormalIn = Vector2Scale(normalIn, cosIn);
-      Vector2 dirRejNormalIn = Vector2Subtract(dir, dirProjNormalIn);
-
-      const float sinIn = sqrtf(1.0f - cosIn * cosIn);
-      const float conservedIn = sinIn * matCur.refractiveIndex;
-      const float sinOut = conservedIn / matNext.refractiveIndex;
-
-
-      // only care if the angle is less than 90 degrees.
-      if (true || cosIn > 0) {
-        if (matNext.kind == OpticMaterialKind::Opaque) {
-          //opaque, stop.
-          DrawCircle(pointNext.x, pointNext.y, 3, BLACK);
-          return results;
-        }
-        else if (matNext.kind == OpticMaterialKind::Reflective) {
-          results.nreflections++;
-          // reflective.
-          dir = Vector2Normalize(Vector2Add(dirRejNormalIn, Vector2Scale(dirProjNormalIn, -2)));
-
-        } else if (matNext.kind == OpticMaterialKind::Refractive) {
-          results.nrefractions++;
-          if (fabs(sinOut) >= 1) {
-            // total internal reflection.
-            dir = Vector2Normalize(Vector2Add(dirRejNormalIn, Vector2Scale(dirProjNormalIn, -2)));
-            // DrawCircle(pointNext.x, pointNext.y, c, (Color) {177, 175, 255, 255}); // total internal reflection color
-          } else {
-            // refraction..
-            const float cosOut = sqrt(1 - sinOut * sinOut);
-            Vector2 newDir = Vector2Add(Vector2Scale(dirProjNormalIn, cosOut), Vector2Scale(dirRejNormalIn, sinOut));
-            dir = Vector2Normalize(newDir);
-          } // end (sinOut > 1)
-        } else {
-          assert(false && "unknown MaterialKind.");
-        }
-      } // end (cosIn > 0)
-    }
-    Color c = { 255, 255, 255, 1}; // light ray color
-    // c.a = 10 * (1.0f - ((float)(isteps) / NSTEPS));
-    DrawLineEx(pointCur, pointNext, 4, c);
-    pointCur = pointNext;
-    matCur = matNext;
+// keeps the segments the ray would draw, so a worker can hand them to the main thread.
+struct PathSink : public NoDraw {
+  Vector2 points[SceneCStep::NSTEPS + 1];
+  int npoints = 0;
+
+  void onSegment(Vector2 pointCur, Vector2 pointNext, int isteps) {
+    if (npoints == 0) { points[npoints++] = pointCur; }
+    points[npoints++] = pointNext;
   }
+};
+
+static RaytraceResults raytrace(Scene s, PathSink &sink, Vector2 start, Vector2 dir, Vector2 bottomLeft, Vector2 topRight) {
+  RaytraceResults results;
+  raymarchMaybeDraw<SceneCStep>(s, start, dir, bottomLeft, topRight, results, sink);
   return results;
 }
 
+// NLADDERS independent replica ladders, with temperatures 1, 2, 4, 8.
+// only the T = 1 chain of each ladder is drawn.
+#define SCENEC_NLADDERS 4
+#define SCENEC_NTEMPERATURES 4
+#define SCENEC_NCHAINS (SCENEC_NLADDERS * SCENEC_NTEMPERATURES)
+#define SCENEC_NSAMPLES_PER_CHAIN 25
+
+struct ThetaSample {
+  float theta;
+  float importance;
+};
 
 typedef struct {
   SDFCircle *circleLeft, *circleRight;
   SDFIntersect *lens;
+  SDFTape lensTape; // lens flattened for tracing, recompiled on layout.
   float lensRadius;
   float lensThickness;
   Vector2 lensCenter;
   Vector2 mousePos;
-  std::vector<float> thetas;
+  Accumulator accum; // every ray traced since the source or lens last changed.
+  AngularHistogram importance; // importance of directions from the current source.
+  TemperedChain chains[SCENEC_NCHAINS]; // ladder l, temperature k at l * NTEMPERATURES + k.
+  ThetaSample proposals[SCENEC_NCHAINS * SCENEC_NSAMPLES_PER_CHAIN]; // this frame's, per chain.
+  PathBuffer coldPaths; // this frame's T = 1 proposals, to splat.
+  int nexchanges; // alternates which neighbours swap.
 } sceneCData;
 
+static void sceneC_resetChains(sceneCData *data) {
+    for(int c = 0; c < SCENEC_NCHAINS; ++c) {
+      TemperedChain &chain = data->chains[c];
+      chain.theta = 2 * M_PI * chain.rng.uniform();
+      chain.importance = 1e-3;
+    }
+}
+
 void* sceneC_init(void) {
     sceneCData *data = new sceneCData;
     data->lensRadius = 1000;
@@ -112,57 +94,129 @@ void* sceneC_init(void) {
     data->circleRight = new SDFCircle();
     data->mousePos = v2(0, 0);
     data->lens = new SDFIntersect(data->circleLeft, data->circleRight);
+    data->accum.exposure = 8;
+    for(int c = 0; c < SCENEC_NCHAINS; ++c) {
+      data->chains[c].rng = ChainRng(c + 1, c);
+      data->chains[c].temperature = 1 << (c % SCENEC_NTEMPERATURES);
+    }
+    sceneC_resetChains(data);
+    data->coldPaths.reserve(SCENEC_NLADDERS * SCENEC_NSAMPLES_PER_CHAIN,
+        SCENEC_NLADDERS * SCENEC_NSAMPLES_PER_CHAIN * (SceneCStep::NSTEPS + 1));
+    data->nexchanges = 0;
     return data;
 };
 
-void sceneC_draw(void *raw_data) {
-    sceneCData *data = (sceneCData *)raw_data;
-    
-    int midX = GetScreenWidth() / 2;
-    int midY = GetScreenHeight() / 2;
+static void sceneC_layout(sceneCData *data, int screenWidth, int screenHeight) {
+    int midX = screenWidth / 2;
+    int midY = screenHeight / 2;
 
     // update SDF
-    data->lensThickness = std::max<int>(0, data->lensThickness + GetMouseWheelMove());
     data->circleLeft->radius = data->lensRadius;
     data->circleRight->radius = data->lensRadius;
     data->circleLeft->center.y = data->circleRight->center.y = midY;
     data->circleLeft->center.x = midX - data->lensRadius + data->lensThickness;
     data->circleRight->center.x = midX + data->lensRadius - data->lensThickness;
+    data->lensTape.compile(data->lens);
+}
 
-    BeginDrawing();
-    ClearBackground({0, 0, 0, 255});
-    Scene s; s.glassSDF = data->lens;
-
-    // const int NRAYS = 180;
-    const Vector2 curMousePos = GetMousePosition();
-    if (curMousePos.x != data->mousePos.x || curMousePos.y != data->mousePos.y) {
-      data->thetas.clear();
-    }
-    data->mousePos = curMousePos;
-    static float curImportance = 1e-3;
-    static float curTheta = 0;
-
-
-    const int NSAMPLES_PER_FRAME = 50;
-    for(int i = 0; i < NSAMPLES_PER_FRAME; ++i) {
-      const float nextTheta = curTheta + (randFloat01() > 0.5 ? 1 : -1 ) * randFloat01() * M_PI / 10;
-      data->thetas.push_back(nextTheta);
+// run one chain for this frame's samples. Called from the pool, so it only
+// touches the chain, its proposal slots and the lock-free path buffer.
+static void sceneC_stepChain(sceneCData *data, Scene s, int c, Vector2 source, int screenWidth, int screenHeight) {
+    TemperedChain &chain = data->chains[c];
+    ThetaSample *proposals = data->proposals + c * SCENEC_NSAMPLES_PER_CHAIN;
+    for(int i = 0; i < SCENEC_NSAMPLES_PER_CHAIN; ++i) {
+      // alternate a local random walk with a jump drawn from the importance histogram.
+      float nextTheta;
+      float proposalRatio = 1;
+      if (chain.rng.uniform() < 0.5) {
+        nextTheta = chain.theta + (chain.rng.uniform() > 0.5 ? 1 : -1 ) * chain.rng.uniform() * M_PI / 10;
+      } else {
+        nextTheta = data->importance.sample(chain.rng.uniform(), chain.rng.uniform(), chain.rng.uniform());
+        proposalRatio = data->importance.pdf(chain.theta) / data->importance.pdf(nextTheta);
+      }
       Vector2 raydir = v2(cos(nextTheta), sin(nextTheta));
-      RaytraceResults result = raytrace(s, curMousePos, raydir, v2(0, 0), v2(GetScreenWidth(), GetScreenHeight()));
+      PathSink path;
+      RaytraceResults result = raytrace(s, path, source, raydir, v2(0, 0), v2(screenWidth, screenHeight));
       const float nextImportance = result.getImportance();
-      // metropolois hastings
-      if (randFloat01() < nextImportance / curImportance) {
-        curTheta = nextTheta;
-        curImportance = nextImportance;
+      proposals[i] = {nextTheta, nextImportance};
+      if (chain.temperature == 1 && path.npoints > 1) {
+        data->coldPaths.push(path.points, path.npoints);
+      }
+      // metropolois hastings, on importance^(1/T).
+      if (chain.rng.uniform() < metropolisAcceptance(nextImportance, chain.importance, chain.temperature, proposalRatio)) {
+        chain.theta = nextTheta;
+        chain.importance = nextImportance;
       } 
     }
+}
+
+static void sceneC_trace(sceneCData *data, Scene s, Vector2 source, int screenWidth, int screenHeight) {
+    if (source.x != data->mousePos.x || source.y != data->mousePos.y) {
+      data->accum.reset();
+      data->importance.clear();
+      sceneC_resetChains(data);
+    }
+    data->mousePos = source;
+
+    data->coldPaths.clear();
+    parallelTrace(s, SCENEC_NCHAINS, 1, [&](Scene ws, int c, int participant) {
+      sceneC_stepChain(data, ws, c, source, screenWidth, screenHeight);
+    });
 
-    for(int i = 0; i < data->thetas.size() - 1; ++i) {
-      float theta = data->thetas[i];
-      Vector2 raydir = v2(cos(theta), sin(theta));
-      raytrace(s, curMousePos, raydir, v2(0, 0), v2(GetScreenWidth(), GetScreenHeight()));
+    // merge in chain order, so the histogram does not depend on scheduling.
+    for(const ThetaSample &p : data->proposals) {
+      data->importance.record(p.theta, p.importance);
+    }
+    // the proposal density stays fixed within a frame.
+    data->importance.rebuild();
+
+    // swap states between neighbouring temperatures, even pairs and odd pairs on alternate frames.
+    for(int l = 0; l < SCENEC_NLADDERS; ++l) {
+      TemperedChain *ladder = data->chains + l * SCENEC_NTEMPERATURES;
+      for(int k = data->nexchanges % 2; k + 1 < SCENEC_NTEMPERATURES; k += 2) {
+        exchangeReplicas(ladder[k], ladder[k + 1], ladder[k].rng.uniform());
+      }
     }
+    data->nexchanges++;
+
+    if (!s.draw) { return; }
+    for(int i = 0; i < data->coldPaths.size(); ++i) {
+      const PathBuffer::Path path = data->coldPaths.paths[i];
+      const Vector2 *points = data->coldPaths.vertices.data() + path.offset;
+      for(int j = 0; j + 1 < path.count; ++j) {
+        data->accum.segment(points[j], points[j + 1], Vector3{1, 1, 1}); // light ray color
+      }
+    }
+}
+
+void sceneC_draw(void *raw_data) {
+    sceneCData *data = (sceneCData *)raw_data;
+
+    const float lensThickness = data->lensThickness;
+    data->lensThickness = std::max<int>(0, data->lensThickness + GetMouseWheelMove());
+    sceneC_layout(data, GetScreenWidth(), GetScreenHeight());
+    data->accum.resize(GetScreenWidth(), GetScreenHeight());
+    if (data->lensThickness != lensThickness) { data->accum.reset(); }
+    // exposure only changes the tonemap, keep the accumulated rays.
+    if (IsKeyDown(KEY_UP)) { data->accum.exposure *= 1.05; }
+    if (IsKeyDown(KEY_DOWN)) { data->accum.exposure /= 1.05; }
+
+    BeginDrawing();
+    ClearBackground({0, 0, 0, 255});
+    Scene s; s.glassSDF = &data->lensTape;
+    sceneC_trace(data, s, GetMousePosition(), GetScreenWidth(), GetScreenHeight());
+    data->accum.endFrame();
+    data->accum.draw();
 
     DrawFPS(10, 10);
     EndDrawing();
 }
+
+void sceneC_bench(void *raw_data, BenchParams params, TraceStats *stats) {
+    sceneCData *data = (sceneCData *)raw_data;
+    data->lensThickness = params.lensThickness;
+    sceneC_layout(data, params.screenWidth, params.screenHeight);
+
+    Scene s; s.glassSDF = &data->lensTape; s.draw = false; s.stats = stats;
+    sceneC_trace(data, s, params.source, params.screenWidth, params.screenHeight);
+}
@@ -1,310 +1,214 @@
 // scene that uses the SDF to decide how to bounce light.
-#include "optics.h"
+#include "lensscene.h"
+#include "spectral.h"
 
 
 #define DISTANCE_APERTURE_TO_LENS 20
 
 
-static SDFResult sdfAABB(Vector2 topLeft, Vector2 bottomRight, Vector2 point) {
-    assert(topLeft.x <= bottomRight.x);
-    assert(topLeft.y <= bottomRight.y);
-    // tl + (br - tl) * 0.5 = tl * 0.5 + br * 0.5 = (tl + br) * 0.5;
-    Vector2 mid = Vector2Scale(Vector2Add(topLeft, bottomRight), 0.5);
-    const int width = bottomRight.x - topLeft.x;
-    const int height = bottomRight.y - topLeft.y;
-
-    Vector2 delta = Vector2Subtract(point, mid);
-    SDFResult result;
-    //                  ||||     [=======]
-    // intersection of: |||| and [=======]
-    //                  ||||     [=======]
-    if (fabs(delta.x) > fabs(delta.y)) {
-      result.dist = fabs(delta.x) - width * 0.5;
-      result.dirOutward = v2(delta.x, 0);
-    } else {
-      result.dist = fabs(delta.y) - height * 0.5;
-      result.dirOutward = v2(0, delta.y);
-    }
-    return result;
-}
-
-struct ScreenData : public SDF {
-  int x;
-  int halfWidth;
-  int halfHeight;
-
-  float valueAt(Vector2 point) {
-    const Vector2 topLeft = v2(x - halfWidth, GetScreenHeight() / 2 - halfHeight);
-    const Vector2 bottomRight = v2(x + halfWidth, GetScreenHeight() / 2 + halfHeight);
-    return sdfAABB(topLeft, bottomRight, point).dist;
-  }
-
-  Vector2 dirOutwardAt(Vector2 point) {
-    const Vector2 topLeft = v2(x - halfWidth, GetScreenHeight() / 2 - halfHeight);
-    const Vector2 bottomRight = v2(x + halfWidth, GetScreenHeight() / 2 + halfHeight);
-    return sdfAABB(topLeft, bottomRight, point).dirOutward;
-  }
-
+struct sceneDData : public LensSceneData {
+  Dispersion glassDispersion; // of the lens, used by the spectral sensor.
+  bool spectral; // fill the sensor with white light split into wavelengths.
 };
 
-
-static void drawScreen(Scene s, ScreenData screenData) {
-  Color color {128, 128, 128, 50};
-    DrawLineEx(v2(screenData.x, GetScreenHeight() / 2 - screenData.halfHeight),
-        v2(screenData.x, GetScreenHeight() / 2 + screenData.halfHeight),
-        screenData.halfWidth * 2, color);
+typedef LensStep<100> SceneDStep;
+
+// flint-like glass, exaggerated like REFRACTIVE_INDEX_GLASS so the color fringes
+// show: one Sellmeier term, through the nominal index at the d line.
+static Dispersion sceneD_glassDispersion() {
+  const float C = 0.025; // um^2, a resonance in the ultraviolet.
+  const float ld = WAVELENGTH_D_LINE * 1e-3;
+  const float n2 = REFRACTIVE_INDEX_GLASS * REFRACTIVE_INDEX_GLASS;
+  const float b[3] = { (n2 - 1) * (ld * ld - C) / (ld * ld), 0, 0 };
+  const float c[3] = { C, 0, 0 };
+  return dispersionSellmeier(b, c);
 }
 
-struct ApertureData : public SDF {
-  int x = 0;
-  float halfOpeningHeight = 0;
-  float halfWidth = 0;
-
-  float valueAt(Vector2 point) {
-    // distance from aperture.
-    if (point.x < x - halfWidth) {
-      return -(point.x - x - halfWidth);
-    } else if (point.x > x + halfWidth) {
-      return point.x - x - halfWidth;
-    } else {
-      // we are inside the box, get distance from the thickness.
-      return halfOpeningHeight - fabs(point.y - GetScreenHeight() / 2);
-    }
-  }
-
-  // return a potentially unnormalized vector in the normal outward direction.
-  // This is the direction of the gradient.
-  Vector2 dirOutwardAt(Vector2 point) {
-    return point.x < x ? v2(-1, 0) : v2(1, 0);
-  }
-};
-
-
-typedef struct {
-  SDFCircle *circleLeft, *circleRight;
-  SDFIntersect *lens;
-  float lensRadius;
-  float lensThickness;
-  Vector2 lensCenter;
-  ApertureData apertureData;
-  ScreenData screenData;
-} sceneDData;
-
-
-static void drawAperture(Scene s, ApertureData apertureData) {
-  Color color {160, 147, 125, 255};
-    DrawLineEx(v2(apertureData.x, 0), 
-        v2(apertureData.x, GetScreenHeight() / 2 - apertureData.halfOpeningHeight), 
-        apertureData.halfWidth, color);
-
-    DrawLineEx(v2(apertureData.x, GetScreenHeight() / 2 + apertureData.halfOpeningHeight),
-        v2(apertureData.x, GetScreenHeight()),
-        apertureData.halfWidth, color);
+static const LensFan SCENED_FAN = { 10, 1000, 150, 20 };
 
+void* sceneD_init(void) {
+    sceneDData *data = new sceneDData;
+    data->glassDispersion = sceneD_glassDispersion();
+    data->spectral = false;
+    lensSceneInit(data, OpticMaterial(OpticMaterialKind::Refractive, REFRACTIVE_INDEX_GLASS, &data->glassDispersion));
+    return data;
 };
 
-static bool DrawCircleAtNextPoint = false;
+static void sceneD_layout(sceneDData *data, int screenWidth, int screenHeight) {
+    int midX = screenWidth / 2;
+    int midY = screenHeight / 2;
 
+    // update SDF
+    // biconvex, cut off where the surfaces meet.
+    data->lensShape.set(v2(midX, midY), 2 * data->lensThickness, data->lensRadius, -data->lensRadius, INFINITY);
+    data->apertureData.halfWidth = 10;
+    data->apertureData.x = data->lensShape.center.x - 0.5f * data->lensShape.thickness - DISTANCE_APERTURE_TO_LENS - data->apertureData.halfWidth * 2;
+    data->apertureData.y = midY;
 
-static void drawLineSegmentSequence(const std::vector<Vector2> &points, int thickness, Color color) {
-  for(int i = 0; i < points.size() - 1; ++i) {
-    Vector2 cur = points[i];
-    Vector2 next = points[i+1];
-    DrawLineEx(cur, next, thickness, color);
-  }
+    data->screenData.x = midX + 5 * data->lensThickness;
+    data->screenData.y = midY;
+    data->screenData.halfWidth = 20;
+    data->screenData.halfHeight = screenHeight / 4;
+    data->elementBVH.build(data->elements, 3);
 }
 
-struct RaytraceResult {
-  bool totalInternalReflected = false;
-  bool refracted = false;
-  bool intersectedAperture = false;
-  Color rayColor;
-  bool intersectedScreen = false;
-  std::vector<Vector2> points = {};
-};
-
-static RaytraceResult raytrace(Scene s, 
-    Color rayColor,
-    ApertureData &apertureData, 
-    ScreenData &screenData,
-    Vector2 start, Vector2 dir, Vector2 bottomLeft, Vector2 topRight) {
-  const float MIN_TRACE_DIST = 0.01;
-  dir = Vector2Normalize(dir);
-  Vector2 pointCur = start;
-  RaytraceResult result;
-  result.rayColor = rayColor;
-  OpticMaterial matCur = materialQuery(s, start);
-
-  const int NSTEPS = 100;
-  for(int isteps = 1; isteps <= NSTEPS; isteps++) {
-    result.points.push_back(pointCur);
-    if (!inbounds(bottomLeft, pointCur, topRight)) { 
-      return result;
-    }
-
-
-    const float distToScreen = screenData.valueAt(pointCur);
-    if (distToScreen < 0) {
-      result.intersectedScreen = true;
-      return result;
-    }
-    const float distToAperture = apertureData.valueAt(pointCur);
-    if (distToAperture < 0) {
-      result.intersectedAperture = true;
-      return result; 
-    }
-    // use distance to glass to decide length of ray.
-    const float distToGlass = s.glassSDF->valueAt(pointCur);
-    float dist = 10000;
-    dist = std::min<float>(dist, fabs(distToAperture));
-    dist = std::min<float>(dist, fabs(distToGlass));
-    dist = std::min<float>(dist, fabs(distToScreen));
-
-    const float rayLength = std::max<float>(dist * 0.9, MIN_TRACE_DIST);
-    Vector2 pointNext = Vector2Add(pointCur, Vector2Scale(dir, rayLength));
-    OpticMaterial matNext = materialQuery(s, pointNext);
-
-    // draw a circle showing how we shot the ray.
-    // if (DrawCircleAtNextPoint) { DrawCircle(pointNext.x, pointNext.y, 10, {100, 100, 100, 50}); }
-
-    // refraction happened, we need to bend the direction now.
-    if (matNext != matCur) {
-      // change of medium.
-
-      Vector2 normalOut = Vector2Normalize(s.glassSDF->dirOutwardAt(pointNext));
-      // normal inward.
-      Vector2 normalIn = Vector2Normalize(Vector2Negate(normalOut)); 
-      const float cosIn = Vector2DotProduct(normalIn, dir);
-
-      // decompose dir into dirProjNormalIn, dirRejNormalIn
-      Vector2 dirProjNormalIn = Vector2Scale(normalIn, cosIn);
-      Vector2 dirRejNormalIn = Vector2Subtract(dir, dirProjNormalIn);
-
-      const float sinIn = sqrtf(1.0f - cosIn * cosIn);
-      const float conservedIn = sinIn * matCur.refractiveIndex;
-      const float sinOut = conservedIn / matNext.refractiveIndex;
-
+// white light from the rays (id = source point) onto the sensor,
+// SPECTRAL_NWAVELENGTHS lanes per ray, weighted by the angle each ray stands
+// for in units of the uniform fan's spacing.
+static void sceneD_traceSpectral(sceneDData *data, Scene s, const std::vector<FanSample> &rays,
+    Vector2 source, int screenWidth, int screenHeight) {
+    const LensFan &fan = SCENED_FAN;
+    const PacketScene ps = lensPacketScene(data, screenWidth, screenHeight);
+    const PacketStep step = lensPacketStep<SceneDStep>();
+    const float raysPerRadian = fan.raysPerRadian();
+    float wavelengths[SPECTRAL_NWAVELENGTHS];
+    Vector3 colors[SPECTRAL_NWAVELENGTHS];
+    spectralWavelengths(wavelengths, SPECTRAL_NWAVELENGTHS);
+    spectralColors(wavelengths, SPECTRAL_NWAVELENGTHS, colors);
+
+    const int GROUP = 64; // rays per task.
+    const int nrays = rays.size();
+    const int ngroups = (nrays + GROUP - 1) / GROUP;
+    parallelTrace(s, ngroups, 1, [&](Scene ws, int g, int participant) {
+      Vector2 starts[GROUP], dirs[GROUP];
+      PacketRayResult out[GROUP * SPECTRAL_NWAVELENGTHS];
+      const int first = g * GROUP;
+      const int n = std::min<int>(GROUP, nrays - first);
+      for(int r = 0; r < n; ++r) {
+        starts[r] = fan.start(source, rays[first + r].id);
+        dirs[r] = v2(cos(rays[first + r].theta), sin(rays[first + r].theta));
+      }
+      traceSpectral(ps, data->glassDispersion, step, starts, dirs, n,
+          wavelengths, SPECTRAL_NWAVELENGTHS, out, ws.stats);
+      for(int l = 0; l < n * SPECTRAL_NWAVELENGTHS; ++l) {
+        if (!out[l].intersectedScreen) { continue; }
+        const float w = rays[first + l / SPECTRAL_NWAVELENGTHS].weight * raysPerRadian;
+        const Vector3 c = colors[l % SPECTRAL_NWAVELENGTHS];
+        data->sensor.record(participant, out[l].point.y, Vector3{c.x * w, c.y * w, c.z * w});
+      }
+    });
+}
 
-      // only care if the angle is less than 90 degrees.
-      if (true || cosIn > 0) {
-        if (matNext.kind == OpticMaterialKind::Opaque) {
-          //opaque, stop.
-          return result;
+static void sceneD_trace(sceneDData *data, Scene s, Vector2 source, int screenWidth, int screenHeight) {
+    const LensFan &fan = SCENED_FAN;
+    std::vector<LensRaytraceResult> &results = data->results;
+    lensTraceBegin(data);
+    if (data->spectral) {
+      // the packet tracer fills the sensor instead of the scalar trace. The
+      // adaptive fan still needs scalar rays to pick its directions; those
+      // are drawn, the others have no paths to draw.
+      std::vector<FanSample> &rays = data->batchRays;
+      if (data->adaptive) {
+        lensTraceAdaptive<SceneDStep>(data, fan, s, source, screenWidth, screenHeight, false);
+        rays.clear();
+        for(int i = 0; i < fan.npoints; ++i) {
+          for(FanSample sample : data->fanSamples[i]) {
+            sample.id = i;
+            rays.push_back(sample);
+          }
         }
-        else if (matNext.kind == OpticMaterialKind::Reflective) {
-          // reflective.
-          dir = Vector2Normalize(Vector2Add(dirRejNormalIn, Vector2Scale(dirProjNormalIn, -2)));
-
-        } else if (matNext.kind == OpticMaterialKind::Refractive) {
-          if (fabs(sinOut) >= 1) {
-            // total internal reflection.
-            result.totalInternalReflected = true;
-            dir = Vector2Normalize(Vector2Add(dirRejNormalIn, Vector2Scale(dirProjNormalIn, -2)));
-            // DrawCircle(pointNext.x, pointNext.y, 2, (Color) {177, 175, 255, 255}); // total internal reflection color
-          } else {
-            // refraction..
-            result.refracted = true;
-            const float cosOut = sqrt(1 - sinOut * sinOut);
-            Vector2 newDir = Vector2Add(Vector2Scale(dirProjNormalIn, cosOut), Vector2Scale(dirRejNormalIn, sinOut));
-            dir = Vector2Normalize(newDir);
-          } // end (sinOut > 1)
-        } else {
-          assert(false && "unknown MaterialKind.");
+      } else {
+        results.clear();
+        if (data->cone) { lensConeRays(data, fan, source, rays); } else { lensUniformRays(fan, rays); }
+      }
+      sceneD_traceSpectral(data, s, rays, source, screenWidth, screenHeight);
+    } else {
+      lensTraceFan<SceneDStep>(data, fan, s, source, screenWidth, screenHeight);
+    }
+    data->sensor.merge();
+    if (!s.draw) { return; }
+
+    // draw on this thread, in trace order.
+    LineBatch &rayLines = data->rayLines;
+    rayLines.clear();
+    for (const LensRaytraceResult &result : results) {
+        const Color rayColor = result.rayColor;
+        if (result.refracted && !result.totalInternalReflected && !result.intersectedAperture) {
+          rayLines.polyline(data->paths.points(result.path), result.path.count, 3, rayColor);
+        } else if (result.intersectedAperture) {
+          Color c = { 200, 200, 200, 5};
+          rayLines.polyline(data->paths.points(result.path), result.path.count, 4, c);
         }
-      } // end (cosIn > 0)
     }
-    pointCur = pointNext;
-    matCur = matNext;
-  }
-  return result;
+    rayLines.draw();
 }
 
-void* sceneD_init(void) {
-    sceneDData *data = new sceneDData;
-    data->lensRadius = 10000;
-    data->lensThickness = 100;
-    data->lensCenter = v2(0, 0);
-    data->circleLeft = new SDFCircle();
-    data->circleRight = new SDFCircle();
-    data->lens = new SDFIntersect(data->circleLeft, data->circleRight);
-    data->apertureData.halfOpeningHeight = 0;
-    data->apertureData.x = 0;
-    return data;
-};
-
 void sceneD_draw(void *raw_data) {
     sceneDData *data = (sceneDData*)raw_data;
     
 
-    if (IsKeyPressed(KEY_SPACE)) {
-      DrawCircleAtNextPoint = !DrawCircleAtNextPoint;
+    if (IsKeyPressed(KEY_S)) {
+      data->spectral = !data->spectral;
+    }
+    if (IsKeyPressed(KEY_A)) {
+      data->adaptive = !data->adaptive;
+    }
+    if (IsKeyPressed(KEY_C)) {
+      data->cone = !data->cone;
+    }
+    if (IsKeyPressed(KEY_P)) {
+      data->tracer = FanTracer(((int)data->tracer + 1) % 3);
     }
 
-    int midX = GetScreenWidth() / 2;
-    int midY = GetScreenHeight() / 2;
-
-    // update SDF
-    // data->lensThickness = std::max<int>(0, data->lensThickness + GetMouseWheelMove());
-    data->circleLeft->radius = data->lensRadius;
-    data->circleRight->radius = data->lensRadius;
-    data->circleLeft->center.y = data->circleRight->center.y = midY;
-    data->circleLeft->center.x = midX - data->lensRadius + data->lensThickness;
-    data->circleRight->center.x = midX + data->lensRadius - data->lensThickness;
     if (IsKeyDown(KEY_LEFT_SHIFT)) {
       data->lensThickness = std::max<int>(0, data->lensThickness + GetMouseWheelMove());
     } else {
       data->apertureData.halfOpeningHeight = std::max<int>(0, data->apertureData.halfOpeningHeight + 5 * GetMouseWheelMove());
     }
-    data->apertureData.halfWidth = 10;
-    data->apertureData.x = data->circleRight->center.x - data->circleRight->radius - DISTANCE_APERTURE_TO_LENS - data->apertureData.halfWidth * 2;
-
-    data->screenData.x = midX + 5 * data->lensThickness;
-    data->screenData.halfWidth = 20;
-    data->screenData.halfHeight = GetScreenHeight() / 4;
+    sceneD_layout(data, GetScreenWidth(), GetScreenHeight());
+    if (IsKeyDown(KEY_UP)) { data->sensor.exposure *= 1.05; }
+    if (IsKeyDown(KEY_DOWN)) { data->sensor.exposure /= 1.05; }
 
     BeginDrawing();
     ClearBackground({240, 240, 240, 255});
-    Scene s; s.glassSDF = data->lens;
+    Scene s = lensScene(data);
+    sceneD_trace(data, s, GetMousePosition(), GetScreenWidth(), GetScreenHeight());
 
-    const int NPOINTS = 10;
-    const int TOTAL_Y = 150;
-    const Vector2 mousePos = GetMousePosition();
-    for(int i = 0; i < NPOINTS; ++i) {
-      float y = mousePos.y + (float(i - NPOINTS/2) / (NPOINTS/2)) * TOTAL_Y;
-      Vector2 rayLoc = v2(mousePos.x, y);
+    drawAperture(data->apertureData);
+    drawScreen(data->screenData);
+    data->sensor.draw(data->screenData.x, data->screenData.halfWidth);
+    DrawText(TextFormat("spot rms %.1f px", data->sensor.rmsWidth()), 10, 40, 20, DARKGRAY);
 
-      const unsigned char r = (float(i) / float(NPOINTS)) * 255;
-      const unsigned char g = fabs(2 * (0.5 - float(i))) / float(NPOINTS) * 255;
-      const unsigned char b = (1.0 - float(i) / float(NPOINTS)) * 255;;
-      Color rayColor = {r, g, b, 20}; 
+    DrawFPS(10, 10);
+    EndDrawing();
+}
 
-      const int NDIRS = 1000;
-      for (int j = 0; j <= NDIRS; ++j) {
-        const float theta = (M_PI * 2.0) * ((float)j / (float)NDIRS);
-        Vector2 rayDir = v2(cos(theta), sin(theta));
-        RaytraceResult result = raytrace(s, rayColor, 
-            data->apertureData,  data->screenData,
-            rayLoc, rayDir, v2(0, 0), v2(GetScreenWidth(), GetScreenHeight()));
-        if (result.intersectedScreen && result.points.size() > 0) {
-          const float y = result.points[result.points.size() - 1].y;
-          const float x = data->screenData.x;
-          Color dotColor = rayColor;
-          dotColor.a = 100;
-          DrawCircle(x, y, 3, dotColor); 
-          // DrawLineEx(cur, next, data->screenData.halfWidth / 4, color);
-        }
-        if (result.refracted && !result.totalInternalReflected && !result.intersectedAperture) {
-          drawLineSegmentSequence(result.points, 3, rayColor);
-        } else if (result.intersectedAperture) {
-          Color c = { 200, 200, 200, 5};
-          drawLineSegmentSequence(result.points, 4, c);
-        }
-      }
-    }
+void sceneD_bench(void *raw_data, BenchParams params, TraceStats *stats) {
+    sceneDData *data = (sceneDData*)raw_data;
+    data->lensThickness = params.lensThickness;
+    data->apertureData.halfOpeningHeight = params.apertureHalfOpeningHeight;
+    sceneD_layout(data, params.screenWidth, params.screenHeight);
 
-    drawAperture(s, data->apertureData);
-    drawScreen(s, data->screenData);
+    Scene s = lensScene(data); s.draw = false; s.stats = stats;
+    sceneD_trace(data, s, params.source, params.screenWidth, params.screenHeight);
+}
 
-    DrawFPS(10, 10);
-    EndDrawing();
+// sceneD_bench with the SIMD packet tracer.
+void sceneD_benchPacket(void *raw_data, BenchParams params, TraceStats *stats) {
+    sceneDData *data = (sceneDData*)raw_data;
+    lensBenchWith(data->tracer, FanTracer::Packet, sceneD_bench, raw_data, params, stats);
+}
+
+// sceneD_bench, with an adaptive fan from each source point.
+void sceneD_benchAdaptive(void *raw_data, BenchParams params, TraceStats *stats) {
+    sceneDData *data = (sceneDData*)raw_data;
+    lensBenchWith(data->adaptive, true, sceneD_bench, raw_data, params, stats);
+}
+
+// sceneD_bench, shooting only through the aperture's opening.
+void sceneD_benchCone(void *raw_data, BenchParams params, TraceStats *stats) {
+    sceneDData *data = (sceneDData*)raw_data;
+    lensBenchWith(data->cone, true, sceneD_bench, raw_data, params, stats);
+}
+
+// sceneD_bench with the wavefront tracer.
+void sceneD_benchWavefront(void *raw_data, BenchParams params, TraceStats *stats) {
+    sceneDData *data = (sceneDData*)raw_data;
+    lensBenchWith(data->tracer, FanTracer::Wavefront, sceneD_bench, raw_data, params, stats);
+}
+
+// sceneD_bench in spectral mode, with the uniform fan.
+void sceneD_benchSpectral(void *raw_data, BenchParams params, TraceStats *stats) {
+    sceneDData *data = (sceneDData*)raw_data;
+    lensBenchWith(data->spectral, true, sceneD_bench, raw_data, params, stats);
 }
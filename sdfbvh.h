@@ -0,0 +1,264 @@
+#pragma once
+// bounding volume hierarchy over many SDF elements.
+//
+// The union of N elements costs N evaluations per query as an SDFUnion chain
+// or a tape. SDFBVH sorts the elements' bounding boxes into a binary tree and
+// answers the nearest element by branch and bound: it descends into the
+// nearer child first, and skips every subtree whose box is farther than the
+// best distance found so far. An element's distance is never smaller than
+// its distance to its box (see SDF::bounds), so the skipped elements cannot
+// win. Elements without bounds are evaluated on every query.
+//
+// Closed-form ray crossings (intersectRay) prune the same way: a node is
+// skipped when the ray enters its box past the nearest crossing found so
+// far, since an element's boundary lies inside its box.
+//
+// Like the tape, the tree copies boxes: rebuild it when elements move.
+#include "optics.h"
+#include <algorithm>
+#include <float.h>
+#include <vector>
+
+struct SDFBVHNode {
+  Vector2 lo, hi;
+  // children, or -1 for a leaf holding elements [first, first + count).
+  int left = -1, right = -1;
+  int first = 0, count = 0;
+};
+
+static const int SDF_BVH_LEAF_SIZE = 4;
+static const int SDF_BVH_MAX_DEPTH = 64;
+
+// lower bound on the distance of anything inside the box [lo, hi] from p:
+// the distance to the box outside it, and -FLT_MAX inside, where an element
+// may be arbitrarily negative.
+static inline float boxLowerBound(Vector2 lo, Vector2 hi, Vector2 p) {
+  const float dx = std::max<float>(std::max<float>(lo.x - p.x, p.x - hi.x), 0);
+  const float dy = std::max<float>(std::max<float>(lo.y - p.y, p.y - hi.y), 0);
+  if (dx == 0 && dy == 0) { return -FLT_MAX; }
+  return sqrtf(dx * dx + dy * dy);
+}
+
+// the interval [t0, t1] over which origin + t dir is inside the box [lo, hi];
+// false when the line misses it.
+static inline bool boxRayInterval(Vector2 lo, Vector2 hi, Vector2 origin, Vector2 dir,
+    float &t0, float &t1) {
+  t0 = -INFINITY;
+  t1 = INFINITY;
+  for(int axis = 0; axis < 2; ++axis) {
+    const float o = axis ? origin.y : origin.x, d = axis ? dir.y : dir.x;
+    const float l = axis ? lo.y : lo.x, h = axis ? hi.y : hi.x;
+    if (d == 0) {
+      if (o < l || o > h) { return false; }
+      continue;
+    }
+    const float ta = (l - o) / d, tb = (h - o) / d;
+    t0 = std::max<float>(t0, std::min<float>(ta, tb));
+    t1 = std::min<float>(t1, std::max<float>(ta, tb));
+  }
+  return t0 <= t1;
+}
+
+struct SDFBVH : public SDF {
+  struct Element {
+    SDF *sdf;
+    int id; // index in the list given to build().
+    Vector2 lo, hi;
+  };
+
+  std::vector<SDFBVHNode> nodes;
+  std::vector<Element> elements; // bounded, in tree order.
+  std::vector<Element> unbounded;
+  std::vector<SDF *> byId;
+  // every element has a closed-form intersectRay, as of build().
+  bool closedForm = true;
+
+  SDFBVH() {};
+  SDFBVH(const std::vector<SDF *> &sdfs) { build(sdfs); }
+
+  // the SDFs of a scene's elements, with their indices as ids.
+  void build(const SceneElement *sceneElements, int n) {
+    std::vector<SDF *> sdfs(n);
+    for(int i = 0; i < n; ++i) { sdfs[i] = sceneElements[i].sdf; }
+    build(sdfs);
+  }
+
+  void build(const std::vector<SDF *> &sdfs) {
+    nodes.clear();
+    elements.clear();
+    unbounded.clear();
+    byId = sdfs;
+    closedForm = true;
+    for(int i = 0; i < (int)sdfs.size(); ++i) {
+      Element e;
+      e.sdf = sdfs[i];
+      e.id = i;
+      // intersectRay only returns false for shapes without a closed form,
+      // whichever ray it is given.
+      RayCrossing probe;
+      if (!e.sdf->intersectRay(v2(0, 0), v2(1, 0), 0, probe)) { closedForm = false; }
+      if (e.sdf->bounds(e.lo, e.hi)) {
+        elements.push_back(e);
+      } else {
+        unbounded.push_back(e);
+      }
+    }
+    if (!elements.empty()) { buildNode(0, elements.size(), 0); }
+  }
+
+  // signed distance to the nearest element, and its id (-1 if there are none).
+  float nearest(Vector2 p, int *id = nullptr) {
+    float best = FLT_MAX;
+    int bestId = -1;
+    for(Element &e : unbounded) {
+      const float d = e.sdf->valueAt(p);
+      if (d < best) { best = d; bestId = e.id; }
+    }
+
+    int stack[SDF_BVH_MAX_DEPTH];
+    int top = 0;
+    if (!nodes.empty()) { stack[top++] = 0; }
+    while (top > 0) {
+      const SDFBVHNode &node = nodes[stack[--top]];
+      if (boxLowerBound(node.lo, node.hi, p) >= best) { continue; }
+      if (node.left < 0) {
+        for(int i = node.first; i < node.first + node.count; ++i) {
+          Element &e = elements[i];
+          if (boxLowerBound(e.lo, e.hi, p) >= best) { continue; }
+          const float d = e.sdf->valueAt(p);
+          if (d < best) { best = d; bestId = e.id; }
+        }
+        continue;
+      }
+      // push the farther child first, so the nearer one is visited first.
+      const float dl = boxLowerBound(nodes[node.left].lo, nodes[node.left].hi, p);
+      const float dr = boxLowerBound(nodes[node.right].lo, nodes[node.right].hi, p);
+      if (dl < dr) {
+        stack[top++] = node.right;
+        stack[top++] = node.left;
+      } else {
+        stack[top++] = node.left;
+        stack[top++] = node.right;
+      }
+    }
+    if (id) { *id = bestId; }
+    return best;
+  }
+
+  // the first crossing after tmin of the ray origin + t dir with any
+  // element's boundary, and the element's id (-1 if there is none). false
+  // unless every element has a closed-form intersectRay.
+  bool intersectRay(Vector2 origin, Vector2 dir, float tmin, RayCrossing &out, int *id) {
+    out = RayCrossing();
+    int bestId = -1;
+    if (!closedForm) { return false; }
+    for(Element &e : unbounded) {
+      RayCrossing c;
+      e.sdf->intersectRay(origin, dir, tmin, c);
+      if (c.t < out.t) { out = c; bestId = e.id; }
+    }
+
+    // nodes on the stack with the ray's entry into their box, the nearer child on top.
+    std::pair<int, float> stack[SDF_BVH_MAX_DEPTH];
+    int top = 0;
+    float t0, t1;
+    if (!nodes.empty() && boxRayInterval(nodes[0].lo, nodes[0].hi, origin, dir, t0, t1) && t1 > tmin) {
+      stack[top++] = {0, t0};
+    }
+    while (top > 0) {
+      const std::pair<int, float> entry = stack[--top];
+      if (entry.second > out.t) { continue; }
+      const SDFBVHNode &node = nodes[entry.first];
+      if (node.left < 0) {
+        for(int i = node.first; i < node.first + node.count; ++i) {
+          Element &e = elements[i];
+          if (!boxRayInterval(e.lo, e.hi, origin, dir, t0, t1) || t1 <= tmin || t0 > out.t) { continue; }
+          RayCrossing c;
+          e.sdf->intersectRay(origin, dir, tmin, c);
+          if (c.t < out.t) { out = c; bestId = e.id; }
+        }
+        continue;
+      }
+      float tl = FLT_MAX, tr = FLT_MAX;
+      const bool hitl = boxRayInterval(nodes[node.left].lo, nodes[node.left].hi, origin, dir, tl, t1) && t1 > tmin;
+      const bool hitr = boxRayInterval(nodes[node.right].lo, nodes[node.right].hi, origin, dir, tr, t1) && t1 > tmin;
+      // push the farther child first, so the nearer one is visited first.
+      if (hitl && hitr && tl < tr) {
+        stack[top++] = {node.right, tr};
+        stack[top++] = {node.left, tl};
+      } else {
+        if (hitl) { stack[top++] = {node.left, tl}; }
+        if (hitr) { stack[top++] = {node.right, tr}; }
+      }
+    }
+    if (id) { *id = bestId; }
+    return true;
+  }
+
+  bool intersectRay(Vector2 origin, Vector2 dir, float tmin, RayCrossing &out) {
+    return intersectRay(origin, dir, tmin, out, nullptr);
+  }
+
+  // the SDF of the element with id, as given to build().
+  SDF *element(int id) { return byId[id]; }
+
+  float valueAt(Vector2 point) { return nearest(point); }
+
+  SDFResult eval(Vector2 point) {
+    int id;
+    const float d = nearest(point, &id);
+    if (id < 0) {
+      SDFResult result;
+      result.dist = d;
+      result.dirOutward = v2(1, 0);
+      return result;
+    }
+    return element(id)->eval(point);
+  }
+
+  Vector2 dirOutwardAt(Vector2 point) { return eval(point).dirOutward; }
+
+  // elements without bounds make the whole tree unbounded.
+  bool bounds(Vector2 &lo, Vector2 &hi) {
+    if (!unbounded.empty() || nodes.empty()) { return false; }
+    lo = nodes[0].lo;
+    hi = nodes[0].hi;
+    return true;
+  }
+
+private:
+  // median split on the longer axis of the element centers.
+  int buildNode(int first, int count, int depth) {
+    const int ix = nodes.size();
+    nodes.push_back(SDFBVHNode());
+    SDFBVHNode node;
+    node.lo = v2(FLT_MAX, FLT_MAX);
+    node.hi = v2(-FLT_MAX, -FLT_MAX);
+    Vector2 clo = node.lo, chi = node.hi;
+    for(int i = first; i < first + count; ++i) {
+      const Element &e = elements[i];
+      node.lo = v2(std::min<float>(node.lo.x, e.lo.x), std::min<float>(node.lo.y, e.lo.y));
+      node.hi = v2(std::max<float>(node.hi.x, e.hi.x), std::max<float>(node.hi.y, e.hi.y));
+      const Vector2 c = Vector2Scale(Vector2Add(e.lo, e.hi), 0.5);
+      clo = v2(std::min<float>(clo.x, c.x), std::min<float>(clo.y, c.y));
+      chi = v2(std::max<float>(chi.x, c.x), std::max<float>(chi.y, c.y));
+    }
+    // the traversal stack holds at most one entry per level plus one.
+    if (count <= SDF_BVH_LEAF_SIZE || depth + 2 >= SDF_BVH_MAX_DEPTH) {
+      node.first = first;
+      node.count = count;
+      nodes[ix] = node;
+      return ix;
+    }
+    const bool splitX = chi.x - clo.x >= chi.y - clo.y;
+    const int mid = first + count / 2;
+    std::nth_element(elements.begin() + first, elements.begin() + mid, elements.begin() + first + count,
+        [splitX](const Element &a, const Element &b) {
+          return splitX ? a.lo.x + a.hi.x < b.lo.x + b.hi.x : a.lo.y + a.hi.y < b.lo.y + b.hi.y;
+        });
+    node.left = buildNode(first, mid - first, depth + 1);
+    node.right = buildNode(mid, first + count - mid, depth + 1);
+    nodes[ix] = node;
+    return ix;
+  }
+};
@@ -0,0 +1,106 @@
+#pragma once
+// expression templates for SDFs whose structure is fixed at compile time.
+//
+// intersect(circle(a), circle(b)) builds a concrete type whose distance is
+// fully inlined, with no virtual calls or heap nodes. Leaves refer to the
+// SDFCircle they were built from, so scenes keep moving the circles around
+// without rebuilding anything. SDFExprAdapter plugs an expression into the
+// SDF interface: the whole expression then costs one virtual call.
+#include "optics.h"
+
+// every node provides `template<typename T> T distance(T x, T y) const`,
+// run on floats for the value and on Duals for value and gradient together.
+// nodes also provide `bool intersectRay(origin, dir, tmin, RayCrossing &out) const`.
+template<typename Derived>
+struct SDFExpr {
+  const Derived &self() const { return static_cast<const Derived &>(*this); }
+};
+
+template<typename E>
+static inline float rayShapeValue(const SDFExpr<E> &e, Vector2 point) {
+  return e.self().distance(point.x, point.y);
+}
+
+template<typename E>
+static inline bool rayShapeCrossing(const SDFExpr<E> &e, Vector2 origin, Vector2 dir, float tmin, RayCrossing &out) {
+  return e.self().intersectRay(origin, dir, tmin, out);
+}
+
+struct CircleExpr : public SDFExpr<CircleExpr> {
+  const SDFCircle *c;
+
+  CircleExpr(const SDFCircle *c) : c(c) {};
+
+  template<typename T>
+  T distance(T x, T y) const { return circleDistance(c->center, c->radius, x, y); }
+
+  bool intersectRay(Vector2 origin, Vector2 dir, float tmin, RayCrossing &out) const {
+    return circleIntersectRay(c->center, c->radius, origin, dir, tmin, out);
+  }
+};
+
+template<typename A, typename B>
+struct IntersectExpr : public SDFExpr<IntersectExpr<A, B>> {
+  A a;
+  B b;
+
+  IntersectExpr(A a, B b) : a(a), b(b) {};
+
+  template<typename T>
+  T distance(T x, T y) const { return dmax(a.distance(x, y), b.distance(x, y)); }
+
+  bool intersectRay(Vector2 origin, Vector2 dir, float tmin, RayCrossing &out) const {
+    return combinedIntersectRay(a, b, true, origin, dir, tmin, out);
+  }
+};
+
+template<typename A, typename B>
+struct UnionExpr : public SDFExpr<UnionExpr<A, B>> {
+  A a;
+  B b;
+
+  UnionExpr(A a, B b) : a(a), b(b) {};
+
+  template<typename T>
+  T distance(T x, T y) const { return dmin(a.distance(x, y), b.distance(x, y)); }
+
+  bool intersectRay(Vector2 origin, Vector2 dir, float tmin, RayCrossing &out) const {
+    return combinedIntersectRay(a, b, false, origin, dir, tmin, out);
+  }
+};
+
+static inline CircleExpr circle(const SDFCircle &c) { return CircleExpr(&c); }
+
+template<typename A, typename B>
+static inline IntersectExpr<A, B> intersect(const SDFExpr<A> &a, const SDFExpr<B> &b) {
+  return IntersectExpr<A, B>(a.self(), b.self());
+}
+
+template<typename A, typename B>
+static inline UnionExpr<A, B> unite(const SDFExpr<A> &a, const SDFExpr<B> &b) {
+  return UnionExpr<A, B>(a.self(), b.self());
+}
+
+// runtime SDF backed by an expression.
+template<typename E>
+struct SDFExprAdapter final : public SDF {
+  E expr;
+
+  SDFExprAdapter(E expr) : expr(expr) {};
+
+  float valueAt(Vector2 point) { return expr.distance(point.x, point.y); }
+  Vector2 dirOutwardAt(Vector2 point) { return eval(point).dirOutward; }
+  SDFResult eval(Vector2 point) {
+    const Dual d = expr.distance(Dual::x(point), Dual::y(point));
+    SDFResult result;
+    result.dirOutward = d.d;
+    result.dist = d.v;
+    return result;
+  }
+  bool intersectRay(Vector2 origin, Vector2 dir, float tmin, RayCrossing &out) {
+    return expr.intersectRay(origin, dir, tmin, out);
+  }
+};
+
+// scene A's lens: two circles intersected.
+typedef SDFExprAdapter<IntersectExpr<CircleExpr, CircleExpr>> SDFLensExpr;
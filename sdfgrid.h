@@ -0,0 +1,61 @@
+#pragma once
+// sampled distance grid over a static SDF.
+//
+// build() samples the source SDF on a uniform grid of nodes; valueAt is then
+// a bilinear lookup. A bilinear blend of a distance field is off by at most
+// the distance to the farthest of the four nodes, cell * sqrt(2), so lookups
+// shrink the magnitude by that margin to stay conservative for marching. Within
+// two margins of the surface, and outside the grid, valueAt falls back to the
+// exact source, so the sign and the interfaces are exact. Gradients are only
+// asked for at interfaces, so eval always goes to the source.
+//
+// The grid copies distances: rebuild it whenever the source changes.
+#include "optics.h"
+#include "threadpool.h"
+#include <vector>
+
+struct SDFGrid : public SDF {
+  SDF *source = nullptr;
+  Vector2 origin = v2(0, 0);
+  float cell = 1;
+  int nx = 0, ny = 0; // nodes along x and y.
+  float margin = 0;
+  std::vector<float> values; // node (i, j) at j * nx + i.
+
+  // sample source over [bottomLeft, topRight] with the given cell size.
+  void build(SDF *sdf, Vector2 bottomLeft, Vector2 topRight, float cellSize) {
+    source = sdf;
+    origin = bottomLeft;
+    cell = cellSize;
+    nx = ceilf((topRight.x - bottomLeft.x) / cell) + 1;
+    ny = ceilf((topRight.y - bottomLeft.y) / cell) + 1;
+    margin = cell * M_SQRT2;
+    values.resize(nx * ny);
+    threadPool().parallelFor(ny, 8, [&](int begin, int end, int participant) {
+      for(int j = begin; j < end; ++j) {
+        for(int i = 0; i < nx; ++i) {
+          values[j * nx + i] = source->valueAt(v2(origin.x + i * cell, origin.y + j * cell));
+        }
+      }
+    });
+  }
+
+  float valueAt(Vector2 point) {
+    const float fx = (point.x - origin.x) / cell;
+    const float fy = (point.y - origin.y) / cell;
+    const int i = floorf(fx);
+    const int j = floorf(fy);
+    if (i < 0 || j < 0 || i + 1 >= nx || j + 1 >= ny) { return source->valueAt(point); }
+    const float tx = fx - i;
+    const float ty = fy - j;
+    const float *row = values.data() + j * nx + i;
+    const float d = (row[0] * (1 - tx) + row[1] * tx) * (1 - ty) +
+      (row[nx] * (1 - tx) + row[nx + 1] * tx) * ty;
+    // narrow band around the surface: exact.
+    if (fabs(d) < 2 * margin) { return source->valueAt(point); }
+    return d > 0 ? d - margin : d + margin;
+  }
+
+  Vector2 dirOutwardAt(Vector2 point) { return source->dirOutwardAt(point); }
+  SDFResult eval(Vector2 point) { return source->eval(point); }
+};
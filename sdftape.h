@@ -0,0 +1,215 @@
+#pragma once
+// flattens an SDF tree into a linear tape of instructions.
+//
+// Every instruction writes the register with its own index, and reads
+// registers written by earlier instructions, so evaluation is one forward
+// walk over a flat array: no pointer chasing or virtual calls for the node
+// kinds the compiler knows about. The distance and gradient come out of the
+// same pass. Unknown SDF subclasses compile to a Call instruction that falls
+// back to the virtual interface.
+//
+// The tape copies node parameters, so recompile it whenever the tree changes
+// (the scenes do it in their layout step, which is a handful of instructions).
+// Ray intersections are not on the tape: they go to the tree it was compiled
+// from. A scene whose Step is ANALYTIC jumps between those crossings and
+// never evaluates the tape; the marching scenes B and C, and the bench's lens
+// field, run on it. Scene A's lens has a fixed shape and is an expression
+// (sdfexpr.h) instead.
+//
+// Registers live in scratch space per thread, as large as the tape, so trees
+// of any size compile, and scene C's chains may share a tape.
+#include "optics.h"
+#include <vector>
+
+enum class SDFTapeOp {
+  Circle,
+  Box,
+  Min,
+  Max,
+  Call,
+  Constant, // the same distance everywhere, in size.x.
+};
+
+struct SDFTapeInstr {
+  SDFTapeOp op;
+  // operand registers for Min / Max.
+  int a = 0, b = 0;
+  // circle center or box center.
+  Vector2 center = v2(0, 0);
+  // circle radius or constant in x, box half extents in (x, y).
+  Vector2 size = v2(0, 0);
+  SDF *sdf = nullptr;
+};
+
+struct SDFTapeReg {
+  float value;
+  Vector2 grad;
+};
+
+struct SDFTape : public SDF {
+  std::vector<SDFTapeInstr> instrs;
+  SDF *source = nullptr; // the tree last compiled.
+
+  SDFTape() {};
+  SDFTape(SDF *root) { compile(root); }
+
+  void compile(SDF *root) {
+    source = root;
+    instrs.clear();
+    emit(root);
+  }
+
+  float valueAt(Vector2 point) { return value(point); }
+  Vector2 dirOutwardAt(Vector2 point) { return eval(point).dirOutward; }
+
+  bool intersectRay(Vector2 origin, Vector2 dir, float tmin, RayCrossing &out) {
+    return source && source->intersectRay(origin, dir, tmin, out);
+  }
+
+  // distance only: registers are plain floats.
+  float value(Vector2 point) const {
+    const int n = instrs.size();
+    if (n == 0) { return INFINITY; } // nothing compiled: nothing to hit.
+    static thread_local std::vector<float> scratch;
+    if ((int)scratch.size() < n) { scratch.resize(n); }
+    float *regs = scratch.data();
+    const SDFTapeInstr *ins = instrs.data();
+    for(int i = 0; i < n; ++i) {
+      switch (ins[i].op) {
+      case SDFTapeOp::Circle: {
+        const float dx = point.x - ins[i].center.x;
+        const float dy = point.y - ins[i].center.y;
+        regs[i] = sqrtf(dx * dx + dy * dy) - ins[i].size.x;
+        break;
+      }
+      case SDFTapeOp::Box: {
+        regs[i] = boxDistance(fabsf(point.x - ins[i].center.x) - ins[i].size.x,
+            fabsf(point.y - ins[i].center.y) - ins[i].size.y);
+        break;
+      }
+      case SDFTapeOp::Min:
+        regs[i] = std::min<float>(regs[ins[i].a], regs[ins[i].b]);
+        break;
+      case SDFTapeOp::Max:
+        regs[i] = std::max<float>(regs[ins[i].a], regs[ins[i].b]);
+        break;
+      case SDFTapeOp::Call:
+        regs[i] = ins[i].sdf->valueAt(point);
+        break;
+      case SDFTapeOp::Constant:
+        regs[i] = ins[i].size.x;
+        break;
+      }
+    }
+    return regs[n - 1];
+  }
+
+  // distance and gradient in one pass.
+  SDFResult eval(Vector2 point) {
+    const int n = instrs.size();
+    if (n == 0) {
+      SDFResult empty;
+      empty.dist = INFINITY;
+      empty.dirOutward = v2(1, 0);
+      return empty;
+    }
+    static thread_local std::vector<SDFTapeReg> scratch;
+    if ((int)scratch.size() < n) { scratch.resize(n); }
+    SDFTapeReg *regs = scratch.data();
+    const SDFTapeInstr *ins = instrs.data();
+    for(int i = 0; i < n; ++i) {
+      SDFTapeReg &out = regs[i];
+      switch (ins[i].op) {
+      case SDFTapeOp::Circle: {
+        const Vector2 delta = Vector2Subtract(point, ins[i].center);
+        const float len = Vector2Length(delta);
+        out.value = len - ins[i].size.x;
+        out.grad = len > 0 ? Vector2Scale(delta, 1.0f / len) : v2(1, 0);
+        break;
+      }
+      case SDFTapeOp::Box: {
+        const Vector2 delta = Vector2Subtract(point, ins[i].center);
+        const float qx = fabs(delta.x) - ins[i].size.x;
+        const float qy = fabs(delta.y) - ins[i].size.y;
+        const float ox = std::max<float>(qx, 0);
+        const float oy = std::max<float>(qy, 0);
+        const float outside = sqrtf(ox * ox + oy * oy);
+        out.value = outside + std::min<float>(std::max<float>(qx, qy), 0);
+        const float sx = delta.x < 0 ? -1 : 1;
+        const float sy = delta.y < 0 ? -1 : 1;
+        if (outside > 0) {
+          out.grad = v2(sx * ox / outside, sy * oy / outside);
+        } else {
+          out.grad = qx > qy ? v2(sx, 0) : v2(0, sy);
+        }
+        break;
+      }
+      case SDFTapeOp::Min:
+        // same tie break as SDFUnion.
+        out = regs[ins[i].a].value < regs[ins[i].b].value ? regs[ins[i].a] : regs[ins[i].b];
+        break;
+      case SDFTapeOp::Max:
+        // same tie break as SDFIntersect.
+        out = regs[ins[i].a].value > regs[ins[i].b].value ? regs[ins[i].a] : regs[ins[i].b];
+        break;
+      case SDFTapeOp::Call: {
+        const SDFResult r = ins[i].sdf->eval(point);
+        out.value = r.dist;
+        out.grad = r.dirOutward;
+        break;
+      }
+      case SDFTapeOp::Constant:
+        out.value = ins[i].size.x;
+        out.grad = v2(1, 0);
+        break;
+      }
+    }
+    SDFResult result;
+    result.dist = regs[n - 1].value;
+    result.dirOutward = regs[n - 1].grad;
+    return result;
+  }
+
+private:
+  // emit instructions for sdf, returning the register holding its value.
+  int emit(SDF *sdf) {
+    SDFTapeInstr ins;
+    if (SDFCircle *circle = dynamic_cast<SDFCircle *>(sdf)) {
+      ins.op = SDFTapeOp::Circle;
+      ins.center = circle->center;
+      ins.size = v2(circle->radius, 0);
+    } else if (SDFAABB *box = dynamic_cast<SDFAABB *>(sdf); box && box->radius == 0) {
+      ins.op = SDFTapeOp::Box;
+      ins.center = box->center();
+      ins.size = box->halfSize();
+    } else if (SDFIntersect *intersect = dynamic_cast<SDFIntersect *>(sdf)) {
+      ins.op = SDFTapeOp::Max;
+      ins.a = emit(intersect->s1);
+      ins.b = emit(intersect->s2);
+    } else if (SDFUnion *sdfunion = dynamic_cast<SDFUnion *>(sdf)) {
+      ins.op = SDFTapeOp::Min;
+      ins.a = emit(sdfunion->s1);
+      ins.b = emit(sdfunion->s2);
+    } else if (SDFTape *tape = dynamic_cast<SDFTape *>(sdf); tape && tape->instrs.empty()) {
+      // an empty tape is nothing to hit, as when it is evaluated on its own.
+      ins.op = SDFTapeOp::Constant;
+      ins.size = v2(INFINITY, 0);
+    } else if (tape) {
+      // inline another tape, shifting its registers.
+      const int base = instrs.size();
+      for(SDFTapeInstr inner : tape->instrs) {
+        if (inner.op == SDFTapeOp::Min || inner.op == SDFTapeOp::Max) {
+          inner.a += base; inner.b += base;
+        }
+        instrs.push_back(inner);
+      }
+      return instrs.size() - 1;
+    } else {
+      // rounded boxes and scene specific SDFs go through the virtual interface.
+      ins.op = SDFTapeOp::Call;
+      ins.sdf = sdf;
+    }
+    instrs.push_back(ins);
+    return instrs.size() - 1;
+  }
+};
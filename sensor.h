@@ -0,0 +1,105 @@
+#pragma once
+// 1D image sensor along a vertical screen.
+//
+// Hits are binned by y into an RGB float array, one bin per pixel of screen
+// height. Tracing threads each fill their own partial histogram, and merge()
+// sums them in participant order at the end of the frame. The merged bins
+// are drawn as one texture strip and can be queried to measure focus (spot
+// centroid and width).
+#include "accum.h"
+#include <vector>
+
+struct Sensor {
+  float y0 = 0;   // y of the first bin.
+  int nbins = 0;  // one per pixel.
+  float exposure = 1;
+  std::vector<Vector3> bins;
+  std::vector<std::vector<Vector3>> partial; // per pool participant.
+  std::vector<Color> pixels;
+  Texture2D texture = {};
+  bool textureLoaded = false;
+
+  // cover [y0, y0 + n) with n bins; clears this frame's partial histograms.
+  void begin(float top, int n, int nparticipants) {
+    if (n != nbins && textureLoaded) { UnloadTexture(texture); textureLoaded = false; }
+    y0 = top;
+    nbins = n;
+    bins.assign(nbins, Vector3{0, 0, 0});
+    partial.resize(nparticipants);
+    for(std::vector<Vector3> &p : partial) { p.assign(nbins, Vector3{0, 0, 0}); }
+  }
+
+  // called from tracing threads.
+  void record(int participant, float y, Vector3 color) {
+    const int b = floorf(y - y0);
+    if (b < 0 || b >= nbins) { return; }
+    Vector3 &v = partial[participant][b];
+    v.x += color.x;
+    v.y += color.y;
+    v.z += color.z;
+  }
+
+  // weight: how many rays of a uniform fan this one stands for.
+  void record(int participant, float y, Color color, float weight = 1) {
+    const float w = weight / 255.0f;
+    record(participant, y, Vector3{color.r * w, color.g * w, color.b * w});
+  }
+
+  void merge() {
+    for(const std::vector<Vector3> &p : partial) {
+      for(int b = 0; b < nbins; ++b) {
+        bins[b].x += p[b].x;
+        bins[b].y += p[b].y;
+        bins[b].z += p[b].z;
+      }
+    }
+  }
+
+  static float luminance(Vector3 c) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+
+  float total() const {
+    float sum = 0;
+    for(const Vector3 &b : bins) { sum += luminance(b); }
+    return sum;
+  }
+
+  // intensity weighted mean y, or y0 when nothing hit.
+  float centroid() const {
+    float sum = 0, sumy = 0;
+    for(int b = 0; b < nbins; ++b) {
+      const float w = luminance(bins[b]);
+      sum += w;
+      sumy += w * (y0 + b + 0.5f);
+    }
+    return sum > 0 ? sumy / sum : y0;
+  }
+
+  // rms distance of the hits from the centroid: the spot size, smaller is sharper.
+  float rmsWidth() const {
+    const float c = centroid();
+    float sum = 0, sumd2 = 0;
+    for(int b = 0; b < nbins; ++b) {
+      const float w = luminance(bins[b]);
+      const float d = y0 + b + 0.5f - c;
+      sum += w;
+      sumd2 += w * d * d;
+    }
+    return sum > 0 ? sqrtf(sumd2 / sum) : 0;
+  }
+
+  // tonemap the bins into a strip covering [x - halfWidth, x + halfWidth].
+  void draw(float x, float halfWidth) {
+    if (nbins == 0) { return; }
+    if (!textureLoaded) {
+      Image image = GenImageColor(1, nbins, BLACK);
+      texture = LoadTextureFromImage(image);
+      UnloadImage(image);
+      textureLoaded = true;
+    }
+    pixels.resize(nbins);
+    for(int b = 0; b < nbins; ++b) { pixels[b] = tonemapReinhard(bins[b], exposure); }
+    UpdateTexture(texture, pixels.data());
+    DrawTexturePro(texture, Rectangle{0, 0, 1, (float)nbins},
+        Rectangle{x - halfWidth, y0, 2 * halfWidth, (float)nbins}, v2(0, 0), 0, WHITE);
+  }
+};
@@ -0,0 +1,87 @@
+#pragma once
+// spectral tracing: one geometric ray at several wavelengths.
+//
+// A dispersive glass bends each wavelength by its own index. Instead of
+// tracing every wavelength as a separate scalar ray, traceSpectral puts the
+// wavelengths of a ray in neighbouring lanes of the packet tracer, each with
+// its own glass index. Until the first refraction the lanes hold the same
+// point and direction, so the shared part of the march costs one packet
+// step; after it they diverge and retire on their own. With PACKET_WIDTH
+// lanes, PACKET_WIDTH / nwavelengths rays share a packet.
+#include "optics.h"
+#include "packet.h"
+
+#define SPECTRAL_NWAVELENGTHS 8
+
+// centers of n equal bands covering the visible range.
+static void spectralWavelengths(float *wavelengths, int n) {
+  for(int i = 0; i < n; ++i) {
+    wavelengths[i] = WAVELENGTH_MIN + (WAVELENGTH_MAX - WAVELENGTH_MIN) * (i + 0.5f) / n;
+  }
+}
+
+// approximate linear RGB of a single wavelength in nm (after Bruton).
+static Vector3 wavelengthColor(float wavelength) {
+  float r = 0, g = 0, b = 0;
+  if (wavelength < 440) { r = (440 - wavelength) / 60; b = 1; }
+  else if (wavelength < 490) { g = (wavelength - 440) / 50; b = 1; }
+  else if (wavelength < 510) { g = 1; b = (510 - wavelength) / 20; }
+  else if (wavelength < 580) { r = (wavelength - 510) / 70; g = 1; }
+  else if (wavelength < 645) { r = 1; g = (645 - wavelength) / 65; }
+  else { r = 1; }
+  // falls off towards the ends of the visible range.
+  float falloff = 1;
+  if (wavelength < 420) { falloff = 0.3f + 0.7f * (wavelength - 380) / 40; }
+  else if (wavelength > 680) { falloff = 0.3f + 0.7f * (WAVELENGTH_MAX + 80 - wavelength) / 100; }
+  return Vector3{r * falloff, g * falloff, b * falloff};
+}
+
+// colors of the wavelengths, scaled per channel so that they add up to white.
+static void spectralColors(const float *wavelengths, int n, Vector3 *colors) {
+  Vector3 sum = {0, 0, 0};
+  for(int i = 0; i < n; ++i) {
+    colors[i] = wavelengthColor(wavelengths[i]);
+    sum.x += colors[i].x; sum.y += colors[i].y; sum.z += colors[i].z;
+  }
+  for(int i = 0; i < n; ++i) {
+    colors[i].x = sum.x > 0 ? colors[i].x / sum.x : 0;
+    colors[i].y = sum.y > 0 ? colors[i].y / sum.y : 0;
+    colors[i].z = sum.z > 0 ? colors[i].z / sum.z : 0;
+  }
+}
+
+// trace each of the n rays at nwavelengths wavelengths through a glass with
+// the given dispersion. out[i * nwavelengths + w] is ray i at wavelengths[w].
+// stats count the n geometric rays, each detected when any of its
+// wavelengths reaches the screen, with the steps and evaluations of all lanes.
+static void traceSpectral(const PacketScene &s, const Dispersion &glass, const PacketStep &step,
+    const Vector2 *starts, const Vector2 *dirs, int n, const float *wavelengths, int nwavelengths,
+    PacketRayResult *out, TraceStats *stats) {
+  float indices[SPECTRAL_NWAVELENGTHS];
+  assert(nwavelengths <= SPECTRAL_NWAVELENGTHS);
+  for(int w = 0; w < nwavelengths; ++w) { indices[w] = glass.indexAt(wavelengths[w]); }
+
+  Vector2 laneStart[PACKET_WIDTH], laneDir[PACKET_WIDTH];
+  float laneIndex[PACKET_WIDTH];
+  TraceStats laneStats;
+  const int nlanes = n * nwavelengths;
+  for(int first = 0; first < nlanes; first += PACKET_WIDTH) {
+    const int count = std::min<int>(PACKET_WIDTH, nlanes - first);
+    for(int l = 0; l < count; ++l) {
+      const int ray = (first + l) / nwavelengths;
+      laneStart[l] = starts[ray];
+      laneDir[l] = dirs[ray];
+      laneIndex[l] = indices[(first + l) % nwavelengths];
+    }
+    tracePacketLanes(s, step, laneStart, laneDir, count, out + first, &laneStats, laneIndex);
+  }
+  if (!stats) { return; }
+  stats->nrays += n;
+  stats->nsteps += laneStats.nsteps;
+  stats->nsdfEvals += laneStats.nsdfEvals;
+  for(int i = 0; i < n; ++i) {
+    bool detected = false;
+    for(int w = 0; w < nwavelengths; ++w) { detected |= out[i * nwavelengths + w].intersectedScreen; }
+    stats->ndetected += detected;
+  }
+}
@@ -0,0 +1,184 @@
+#pragma once
+// persistent work-stealing thread pool.
+//
+// parallelFor splits [0, n) into chunks and hands each participant (the
+// workers plus the calling thread) a contiguous block of chunks in its own
+// deque. A participant pops from the back of its own deque and, once it runs
+// dry, steals from the front of the others'. parallelFor returns when every
+// chunk has run. It is meant to be called from one thread (the raylib thread)
+// and must not be nested.
+//
+// Results stay deterministic as long as each index writes its own slot;
+// parallelTrace additionally gives every participant its own TraceStats and
+// sums them in order at the end.
+#include "optics.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct WorkRange {
+  int begin;
+  int end;
+};
+
+struct WorkQueue {
+  std::mutex mutex;
+  std::deque<WorkRange> ranges;
+
+  void push(WorkRange r) {
+    std::lock_guard<std::mutex> lock(mutex);
+    ranges.push_back(r);
+  }
+
+  // owner end.
+  bool pop(WorkRange &r) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (ranges.empty()) { return false; }
+    r = ranges.back();
+    ranges.pop_back();
+    return true;
+  }
+
+  // thief end.
+  bool steal(WorkRange &r) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (ranges.empty()) { return false; }
+    r = ranges.front();
+    ranges.pop_front();
+    return true;
+  }
+};
+
+struct ThreadPool {
+  // fn(begin, end, participant), participant 0 is the calling thread.
+  typedef std::function<void(int, int, int)> Job;
+
+  ThreadPool(int nthreads) {
+    // participant 0 is the thread calling parallelFor.
+    for(int i = 0; i < nthreads + 1; ++i) {
+      queues.emplace_back(new WorkQueue());
+    }
+    for(int i = 0; i < nthreads; ++i) {
+      threads.emplace_back([this, i] { workerLoop(i + 1); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = true;
+    }
+    wake.notify_all();
+    for(std::thread &t : threads) { t.join(); }
+  }
+
+  int nparticipants() const { return queues.size(); }
+
+  void parallelFor(int n, int chunkSize, const Job &fn) {
+    if (n <= 0) { return; }
+    const int nchunks = (n + chunkSize - 1) / chunkSize;
+    if (threads.empty() || nchunks == 1) {
+      fn(0, n, 0);
+      return;
+    }
+
+    job = &fn;
+    remaining = nchunks;
+    // contiguous blocks of chunks per participant, for locality.
+    const int nparts = nparticipants();
+    for(int c = 0; c < nchunks; ++c) {
+      const int owner = (long long)c * nparts / nchunks;
+      queues[owner]->push({c * chunkSize, std::min<int>(n, (c + 1) * chunkSize)});
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      generation++;
+    }
+    wake.notify_all();
+
+    runChunks(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return remaining.load() == 0; });
+    job = nullptr;
+  }
+
+private:
+  std::vector<std::unique_ptr<WorkQueue>> queues;
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  const Job *job = nullptr;
+  std::atomic<int> remaining{0};
+  long long generation = 0;
+  bool quit = false;
+
+  bool next(int participant, WorkRange &r) {
+    if (queues[participant]->pop(r)) { return true; }
+    const int nparts = nparticipants();
+    for(int k = 1; k < nparts; ++k) {
+      if (queues[(participant + k) % nparts]->steal(r)) { return true; }
+    }
+    return false;
+  }
+
+  void runChunks(int participant) {
+    WorkRange r;
+    while (next(participant, r)) {
+      (*job)(r.begin, r.end, participant);
+      if (remaining.fetch_sub(1) == 1) {
+        std::lock_guard<std::mutex> lock(mutex);
+        done.notify_all();
+      }
+    }
+  }
+
+  void workerLoop(int participant) {
+    long long seen = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&] { return quit || generation != seen; });
+        if (quit) { return; }
+        seen = generation;
+      }
+      runChunks(participant);
+    }
+  }
+};
+
+// the pool shared by all scenes, sized to the machine. inline, not static:
+// every translation unit that includes this header gets the same pool.
+inline ThreadPool &threadPool() {
+#if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+  static ThreadPool pool(0);
+#else
+  static ThreadPool pool(std::max<int>(0, (int)std::thread::hardware_concurrency() - 1));
+#endif
+  return pool;
+}
+
+// run fn(scene, i, participant) for i in [0, n) across the pool. Each
+// participant traces with its own copy of the scene whose stats are merged
+// into s.stats after.
+template<typename Fn>
+static void parallelTrace(Scene s, int n, int chunkSize, Fn fn) {
+  ThreadPool &pool = threadPool();
+  std::vector<TraceStats> stats(pool.nparticipants());
+  pool.parallelFor(n, chunkSize, [&](int begin, int end, int participant) {
+    Scene local = s;
+    if (s.stats) { local.stats = &stats[participant]; }
+    for(int i = begin; i < end; ++i) { fn(local, i, participant); }
+  });
+  if (s.stats) {
+    for(const TraceStats &st : stats) {
+      s.stats->nrays += st.nrays;
+      s.stats->nsteps += st.nsteps;
+      s.stats->nsdfEvals += st.nsdfEvals;
+      s.stats->ndetected += st.ndetected;
+    }
+  }
+}
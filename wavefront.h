@@ -0,0 +1,222 @@
+#pragma once
+// wavefront tracer for the two-circle lens scenes.
+//
+// tracePacket runs a packet until its last lane retires, so one long-lived
+// ray keeps PACKET_WIDTH - 1 dead lanes stepping. The wavefront tracer
+// instead keeps every live ray in structure-of-arrays queues and runs one
+// stage kernel at a time over the whole queue:
+//   march     - retire rays that left the screen or hit the aperture or
+//               screen, advance the others and note which changed medium.
+//   interface - bend the rays that changed medium (Snell or TIR), gathered
+//               into their own dense list.
+//   record    - write the result of every ray that retired this step.
+//   compact   - squeeze retired rays out, so the next march runs dense.
+// The stages run the kernels of tracePacket (PacketKernel), so the physics
+// and the results are the same; only the order in which rays are stepped
+// differs.
+#include "optics.h"
+#include "packet.h"
+#include <vector>
+
+enum WavefrontFlag {
+  WAVEFRONT_DONE = 1,
+  WAVEFRONT_REFRACTED = 2,
+  WAVEFRONT_TIR = 4,
+  WAVEFRONT_APERTURE = 8,
+  WAVEFRONT_SCREEN = 16,
+};
+
+// live rays in structure-of-arrays layout, padded to whole packets so that
+// kernels can load PACKET_WIDTH lanes past the end.
+struct WavefrontQueue {
+  int size = 0;
+  std::vector<float> px, py, dx, dy;
+  std::vector<float> glassIndex;
+  std::vector<float> inGlass; // 1 inside the lens, 0 outside.
+  std::vector<float> nsteps;
+  std::vector<int> id; // index of the ray in the caller's arrays.
+  std::vector<unsigned char> flags; // WavefrontFlag bits.
+  std::vector<int> crossed; // queue slots that changed medium this step.
+  std::vector<int> retired; // queue slots that finished this step.
+
+  void reset(int n) {
+    size = n;
+    const int capacity = (n + PACKET_WIDTH - 1) / PACKET_WIDTH * PACKET_WIDTH;
+    for(std::vector<float> *v : {&px, &py, &dx, &dy, &glassIndex, &inGlass, &nsteps}) {
+      v->assign(capacity, 0);
+    }
+    id.assign(capacity, 0);
+    flags.assign(capacity, 0);
+    crossed.clear();
+    crossed.reserve(capacity);
+    retired.clear();
+    retired.reserve(capacity);
+  }
+};
+
+// one step of every ray in the queue.
+static void wavefrontMarch(const PacketKernel &w, const PacketStep &step, WavefrontQueue &q, long long &nevals) {
+  q.crossed.clear();
+  q.retired.clear();
+  for(int i = 0; i < q.size; i += PACKET_WIDTH) {
+    const int n = std::min<int>(PACKET_WIDTH, q.size - i);
+    floatv px = vload(&q.px[i]), py = vload(&q.py[i]);
+    const floatv dx = vload(&q.dx[i]), dy = vload(&q.dy[i]);
+    maskv inGlass = vlt(w.zero, vload(&q.inGlass[i]));
+    const floatv nsteps = vload(&q.nsteps[i]) + w.one;
+    vstore(&q.nsteps[i], nsteps);
+
+    const maskv started = vmaskfirst(n);
+    maskv alive = started;
+    maskv hitAperture, hitScreen, crossed;
+    w.step(alive, px, py, dx, dy, inGlass, hitAperture, hitScreen, crossed, nevals);
+    vstore(&q.px[i], px);
+    vstore(&q.py[i], py);
+    vstore(&q.inGlass[i], vselect(inGlass, w.one, w.zero));
+    // out of bounds, stopped by the aperture or screen, or out of steps with
+    // the point just reached.
+    const maskv done = vandnot(started, alive) | (alive & vge(nsteps, vbroadcast(step.nsteps)));
+
+    // most steps neither cross nor retire anything: only visit the set lanes.
+    for(int bits = vbits(crossed); bits; bits &= bits - 1) {
+      q.crossed.push_back(i + __builtin_ctz(bits));
+    }
+    const int apertureBits = vbits(hitAperture), screenBits = vbits(hitScreen);
+    for(int bits = vbits(done); bits; bits &= bits - 1) {
+      const int l = __builtin_ctz(bits);
+      unsigned char f = WAVEFRONT_DONE;
+      if ((apertureBits >> l) & 1) { f |= WAVEFRONT_APERTURE; }
+      if ((screenBits >> l) & 1) { f |= WAVEFRONT_SCREEN; }
+      q.flags[i + l] |= f;
+      q.retired.push_back(i + l);
+    }
+  }
+}
+
+// bend the rays that changed medium, PACKET_WIDTH of them at a time.
+static void wavefrontResolveInterfaces(const PacketKernel &w, WavefrontQueue &q, long long &nevals) {
+  float buf[6][PACKET_WIDTH] = {};
+  const int ncrossed = q.crossed.size();
+  for(int first = 0; first < ncrossed; first += PACKET_WIDTH) {
+    const int n = std::min<int>(PACKET_WIDTH, ncrossed - first);
+    for(int l = 0; l < n; ++l) {
+      const int k = q.crossed[first + l];
+      buf[0][l] = q.px[k]; buf[1][l] = q.py[k];
+      buf[2][l] = q.dx[k]; buf[3][l] = q.dy[k];
+      buf[4][l] = q.inGlass[k]; buf[5][l] = q.glassIndex[k];
+    }
+    const floatv nx = vload(buf[0]), ny = vload(buf[1]);
+    floatv dx = vload(buf[2]), dy = vload(buf[3]);
+    // the ray is already in its new medium; it came from the other one.
+    const maskv inGlassNext = vlt(w.zero, vload(buf[4]));
+    const floatv glassIndex = vload(buf[5]);
+    nevals += n;
+
+    maskv isTir;
+    w.bend(vmaskfirst(n), nx, ny, dx, dy,
+        vselect(inGlassNext, w.one, glassIndex), vselect(inGlassNext, glassIndex, w.one), isTir);
+    vstore(buf[2], dx);
+    vstore(buf[3], dy);
+
+    const int tirBits = vbits(isTir);
+    for(int l = 0; l < n; ++l) {
+      const int k = q.crossed[first + l];
+      q.dx[k] = buf[2][l]; q.dy[k] = buf[3][l];
+      q.flags[k] |= (tirBits >> l) & 1 ? WAVEFRONT_TIR : WAVEFRONT_REFRACTED;
+    }
+  }
+}
+
+// write out the rays that retired this step.
+static void wavefrontRecord(const WavefrontQueue &q, PacketRayResult *out, TraceStats *stats) {
+  for(int k : q.retired) {
+    const unsigned char f = q.flags[k];
+    PacketRayResult &r = out[q.id[k]];
+    r.point = v2(q.px[k], q.py[k]);
+    r.dir = v2(q.dx[k], q.dy[k]);
+    r.nsteps = q.nsteps[k];
+    r.refracted = f & WAVEFRONT_REFRACTED;
+    r.totalInternalReflected = f & WAVEFRONT_TIR;
+    r.intersectedAperture = f & WAVEFRONT_APERTURE;
+    r.intersectedScreen = f & WAVEFRONT_SCREEN;
+    if (stats) {
+      stats->nsteps += r.nsteps;
+      stats->ndetected += r.intersectedScreen;
+    }
+  }
+}
+
+// move the live rays to the front of the queue, keeping their order.
+static void wavefrontCompact(WavefrontQueue &q) {
+  if (q.retired.empty()) { return; }
+  // everything before the first retired slot stays where it is.
+  int live = q.retired[0];
+  for(int k = live; k < q.size; ++k) {
+    if (q.flags[k] & WAVEFRONT_DONE) { continue; }
+    if (live != k) {
+      q.px[live] = q.px[k]; q.py[live] = q.py[k];
+      q.dx[live] = q.dx[k]; q.dy[live] = q.dy[k];
+      q.glassIndex[live] = q.glassIndex[k];
+      q.inGlass[live] = q.inGlass[k];
+      q.nsteps[live] = q.nsteps[k];
+      q.id[live] = q.id[k];
+      q.flags[live] = q.flags[k];
+    }
+    live++;
+  }
+  q.size = live;
+}
+
+// rays in flight at once: the queues of a tile stay in L1/L2 across stages.
+static const int WAVEFRONT_TILE = 2048;
+
+// trace n rays to completion, with the results of tracePacket.
+// indices[0..n) is the glass index of each ray, s.refractiveIndex for all when null.
+// queue is scratch space, kept by the caller to reuse its allocations.
+static void traceWavefront(const PacketScene &s, const PacketStep &step,
+    const Vector2 *starts, const Vector2 *dirs, int n, PacketRayResult *out, TraceStats *stats,
+    WavefrontQueue &q, const float *indices = nullptr) {
+  const PacketKernel w(s, step);
+  long long nevals = n;
+  for(int first = 0; first < n; first += WAVEFRONT_TILE) {
+    const int count = std::min<int>(WAVEFRONT_TILE, n - first);
+    q.reset(count);
+    for(int k = 0; k < count; ++k) {
+      const Vector2 dir = Vector2Normalize(dirs[first + k]);
+      q.px[k] = starts[first + k].x; q.py[k] = starts[first + k].y;
+      q.dx[k] = dir.x; q.dy[k] = dir.y;
+      q.glassIndex[k] = indices ? indices[first + k] : s.refractiveIndex;
+      q.id[k] = k;
+    }
+    // which side of the lens the rays start on.
+    for(int i = 0; i < count; i += PACKET_WIDTH) {
+      const maskv in = vle(w.lensDist(vload(&q.px[i]), vload(&q.py[i])), w.zero);
+      vstore(&q.inGlass[i], vselect(in, w.one, w.zero));
+    }
+
+    while (q.size > 0) {
+      wavefrontMarch(w, step, q, nevals);
+      wavefrontResolveInterfaces(w, q, nevals);
+      wavefrontRecord(q, out + first, stats);
+      wavefrontCompact(q);
+    }
+  }
+  if (stats) {
+    stats->nrays += n;
+    stats->nsdfEvals += nevals;
+  }
+}
+
+// what a scene shoots its fan with: raytrace, or one of the batch tracers.
+enum class FanTracer { Scalar, Packet, Wavefront };
+
+// tracePacket or traceWavefront, by tracer; q is only used by the wavefront tracer.
+static void traceBatch(FanTracer tracer, const PacketScene &s, const PacketStep &step,
+    const Vector2 *starts, const Vector2 *dirs, int n, PacketRayResult *out, TraceStats *stats,
+    WavefrontQueue &q, const float *indices = nullptr) {
+  if (tracer == FanTracer::Wavefront) {
+    traceWavefront(s, step, starts, dirs, n, out, stats, q, indices);
+  } else {
+    tracePacket(s, step, starts, dirs, n, out, stats, indices);
+  }
+}